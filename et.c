@@ -7,32 +7,87 @@
 
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <ctype.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
 #include <unistd.h>
 
+/*
+ * On Linux the file I/O is done through io_uring(7) when the kernel
+ * lets us, see `ur_init'.
+ */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define HAVE_URING
+#endif
+#endif
+
+/*
+ * On Linux the signals, timers and wakeups of the main loop are all
+ * descriptors (see `ev_wait'); elsewhere it makes do with pipes.
+ */
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#define HAVE_EVFD
+#endif
+
 
 typedef unsigned short US;
+/*
+ * One character cell of the screen: the character itself in lower
+ * `CELL_CH_BITS' bits and its attributes (`AT_*') in the upper ones.
+ */
+typedef unsigned int CELL;
 
 
 /* Size for input/output buffer `buf'. */
 #define IOBUF 4096
+/* Size of one read or write request of the file I/O. */
+#define IO_CHUNK (1024 * 1024)
+/* How many file I/O requests are kept in flight at once. */
+#define IO_QD 8
 /* By how many lines the `lns' extended when it is not enough space. */
 #define LNS_EXPAND 64
 /* By how many lines the line's string is extended when it needs space. */
 #define LN_EXPAND 64
+/* How many lines make up one block when the buffer is written out. */
+#define WR_BLK 4096
+/* Buffers smaller than this many bytes are written by a single thread. */
+#define WR_PAR_MIN (8 * 1024 * 1024)
+/* Upper limit of threads that write the buffer out in parallel. */
+#define WR_THR_MAX 16
+/*
+ * Buffers with fewer lines than this are filtered by a single thread
+ * (see `fl_scan'), and the upper limit of the threads.
+ */
+#define FL_PAR_MIN (64 * 1024)
+#define FL_THR_MAX 16
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 /* Which symbol indicates an empty lines. */
 #define EMPT_LN_MARK "~"
+/* Which symbol parts the views side by side. */
+#define VW_SEP '|'
 /* Symbol we prepend a filename with dirty buffer with. */
 #define DIRTY_MARK "*"
 #define CMD_ESC ":"
@@ -51,6 +106,37 @@ typedef unsigned short US;
 #define TABSIZE 8
 /* How many lines do we scroll down/up. */
 #define SCRL_LN 8
+/*
+ * The number of bytes between the column checkpoints of a line (see
+ * `struct ln').  Lines shorter than that don't need them.
+ */
+#define CK_STEP 256
+/* The longest UTF-8 sequence. */
+#define UTF8_MAX 4
+/*
+ * Lines longer than this are not highlighted (see `hl_ln'), so that
+ * a huge one doesn't have to be lexed on every redraw.
+ */
+#define HL_LN_MAX 8192
+/*
+ * The most views the screen may be split into, and the fewest rows
+ * (with the status line) and columns a view that is split has.
+ */
+#define VW_MAX 16
+#define VW_MIN_ROWS 4
+#define VW_MIN_COLS (2*TABSIZE + 1)
+/* The most event sources the main loop waits for (see `evs'). */
+#define EV_MAX 16
+/* Keyboard macros are kept in the registers `a'-`z' (see `mcs'). */
+#define MC_N 26
+#define IS_MC(C) ((C) >= 'a' && (C) <= 'z')
+/*
+ * The markers of the start and the end of a fold in the text (see
+ * `fd_end'), and what is shown after the line that is folded.
+ */
+#define FD_BEG "{{{"
+#define FD_END "}}}"
+#define FD_MARK "+--"
 
 /* The length of visual ``ruler'' to be printed in status line. */
 #define RULER 80
@@ -79,16 +165,162 @@ typedef unsigned short US;
 #define MOD_EDT 2
 #define MOD_SEA 3
 
+/* Initial size of the frame buffer `obuf'. */
+#define OBUF 16384
+/*
+ * How long (in ms) do we wait for the terminal to answer the queries
+ * about its features (see `query_term').
+ */
+#define QUERY_TIMEOUT 200
+/*
+ * How long (in ms) do we wait for the rest of an escape sequence after
+ * `ESC' (unless `ESCDELAY' in the environment says otherwise).  The
+ * terminal sends a sequence at once, so if nothing follows, it's the
+ * `ESC' key itself (see `in_key').
+ */
+#define ESC_DELAY 25
+/*
+ * How long (in ms) do we let the window size settle before the screen
+ * is laid out for it, i.e. at most how often that's done while the
+ * window is being resized (see `rd_sigwinch').
+ */
+#define RSZ_DELAY 33
+/*
+ * Keys that come as escape sequences (see `in_key').  `KEY_NONE' is
+ * a sequence we don't make use of, `KEY_ESC' is the `ESC' key itself
+ * and `KEY_PST' begins a paste.
+ */
+#define KEY_NONE 0
+#define KEY_ESC 1
+#define KEY_PST 2
+#define KEY_UP 3
+#define KEY_DOWN 4
+#define KEY_RIGHT 5
+#define KEY_LEFT 6
+#define KEY_HOME 7
+#define KEY_END 8
+#define KEY_PGUP 9
+#define KEY_PGDN 10
+#define KEY_N 11
+/* The longest key sequence taken from terminfo(5) (see `tkey'). */
+#define TKEY_MAX 16
+
+/*
+ * Control Sequence Introducer: starts the command for moving terminal
+ * cursor to the row and column, which are written by `ob_mv'.
+ */
+#define CSI "\x1b["
+/*
+ * Begin and end synchronized update: the terminal does not show the
+ * screen contents between these two (see `ob_flush').
+ */
+#define BSU_CMD "\x1b[?2026h"
+#define ESU_CMD "\x1b[?2026l"
+/*
+ * Turn bracketed paste on and off: the terminal puts what is pasted
+ * between `CSI 200 ~' (see `KEY_PST') and `PST_END' then.
+ */
+#define PST_ON_CMD "\x1b[?2004h"
+#define PST_OFF_CMD "\x1b[?2004l"
+#define PST_END "\x1b[201~"
 /*
- * String command for moving terminal cursor to the row `R' and column `C'.
- * It is not intended to be used "as is".  Rather, it's supposed to be used
- * in `MV_CURS' macro, where it's used as a format-string for `dprintf'.
+ * Ask the terminal whether it knows about synchronized update, and
+ * ask for its primary attributes (every terminal answers the latter).
  */
-#define MV_CURS_CMD "\x1b[%d;%dH"
+#define SYNC_UPD_QUERY "\x1b[?2026$p\x1b[c"
 /* Enter reverse video mode, i.e. swap fore- and background colors. */
 #define REV_VID_CMD "\x1b[7m"
 /* Reset video mode. */
 #define VID_RST_CMD "\x1b[0m"
+/* Reset video mode and set the attributes that follow (see `ob_at'). */
+#define SGR_CMD "\x1b[0"
+/*
+ * Set the scrolling region to the rows written before `r' (see
+ * `ob_rgn') and reset it to the whole screen.
+ */
+#define RGN_CMD "r"
+#define RGN_RST_CMD "\x1b[r"
+/* Scroll the scrolling region up and down by the number before these. */
+#define SCRL_UP_CMD "S"
+#define SCRL_DWN_CMD "T"
+/*
+ * Scroll the region one line up (it's just a newline at its bottom)
+ * and down (at its top).
+ */
+#define IND_CMD "\n"
+#define RI_CMD "\x1bM"
+/* Insert and delete the number (written before) of lines at the cursor. */
+#define IL_CMD "L"
+#define DL_CMD "M"
+/* Insert and delete the number of characters at the cursor. */
+#define ICH_CMD "@"
+#define DCH_CMD "P"
+/* Erase the number of characters from the cursor on. */
+#define ECH_CMD "X"
+/* Repeat the last printed character the number of times. */
+#define REP_CMD "b"
+/*
+ * Move the cursor up, down, forward and back by the number before
+ * these (by one, without a number).
+ */
+#define CUU_CMD "A"
+#define CUD_CMD "B"
+#define CUF_CMD "C"
+#define CUB_CMD "D"
+/* Move the cursor to the row and column before this. */
+#define CUP_CMD "H"
+
+/*
+ * Terminal capabilities we make use of (see `tcap').  Every one is
+ * a bit for the string capability at `TI_*' index of terminfo(5).
+ */
+#define TC_CSR	0x001
+#define TC_SU	0x002
+#define TC_SD	0x004
+#define TC_IL	0x008
+#define TC_DL	0x010
+#define TC_ICH	0x020
+#define TC_DCH	0x040
+#define TC_ECH	0x080
+#define TC_REP	0x100
+#define TI_CSR	3
+#define TI_ECH	37
+#define TI_DCH	105
+#define TI_DL	106
+#define TI_ICH	108
+#define TI_SU	109
+#define TI_IL	110
+#define TI_SD	113
+#define TI_REP	121
+/* The strings the cursor keys send, see `tkey'. */
+#define TI_KCUD1 61
+#define TI_KHOME 76
+#define TI_KCUB1 79
+#define TI_KNP	81
+#define TI_KPP	82
+#define TI_KCUF1 83
+#define TI_KCUU1 87
+#define TI_KEND	164
+/* Magic numbers of the compiled terminfo(5) entries. */
+#define TI_MAGIC 0432
+#define TI_MAGIC32 01036
+/*
+ * What is assumed if there's no terminfo(5) entry for the terminal:
+ * most of them are xterm(1) descendants (see `rd_tinfo').
+ */
+#define TC_DEFAULT \
+	(TC_CSR | TC_SU | TC_SD | TC_IL | TC_DL | TC_ICH | TC_DCH | TC_ECH)
+/*
+ * How many characters may be inserted to or deleted from the middle of
+ * a row for that to be found out (see `scr_chsh_find').
+ */
+#define CHSH_MAX 8
+/*
+ * Runs of blank cells and of repeated characters at least this long are
+ * erased and repeated, instead of being sent one by one (see `scr_put').
+ */
+#define ECH_MIN 12
+#define REP_MIN 8
 /* Erase the whole screen contents. */
 #define ERS_ALL_CMD "\x1b[2J"
 /* Erase forward to the end of screen. */
@@ -109,30 +341,154 @@ typedef unsigned short US;
 	lns[I]->l = 0;				\
 	lns[I]->sz = 0;				\
 	lns[I]->str = NULL;			\
+	lns[I]->ascii = -1;			\
+	lns[I]->hl_st = HL_ST_UNK;		\
+	lns[I]->hl_new = 1;			\
+	lns[I]->wr_new = 1;			\
 	EXPAND_LN(I, LN_EXPAND);		\
 } while (0)
 
+/* Bits of `CELL' taken by the character. */
+#define CELL_CH_BITS 21
+#define CELL_CH(C) ((C) & ((1 << CELL_CH_BITS) - 1))
+#define CELL_AT(C) ((C) >> CELL_CH_BITS)
+#define MK_CELL(CH, AT) ((CELL)(CH) | (CELL)(AT) << CELL_CH_BITS)
+/* An empty cell, i.e. the one an erased screen consists of. */
+#define BLANK MK_CELL(' ', 0)
+/*
+ * The character of the cell that follows a wide (double-width) one:
+ * the terminal draws the latter over both.  It's not a code point.
+ */
+#define WIDE_CONT 0x1fffff
+/* Cell attribute: reverse video. */
+#define AT_REV 1
+/*
+ * Cell attribute: foreground color from `1' to `7' (see `ob_at'),
+ * `0' is the default one.
+ */
+#define AT_FG(C) ((C) << 1)
+#define AT_FG_OF(AT) ((AT) >> 1 & 7)
+/* Cell attribute: underline. */
+#define AT_UL 16
+
+/* Attributes of the highlighted text (see `hl_ln'). */
+#define HL_CMT	AT_FG(6)
+#define HL_STR	AT_FG(2)
+#define HL_KW	AT_FG(3)
+#define HL_NUM	AT_FG(5)
+#define HL_PP	AT_FG(5)
+#define HL_VAR	AT_FG(4)
+#define HL_ERR	AT_FG(1)
+#define HL_WARN	AT_FG(3)
+#define HL_INFO	AT_FG(2)
+/*
+ * Lexer states: the one a text starts in, and the one of a line that
+ * has never been lexed.  The rest are up to the language.
+ */
+#define HL_ST_NONE 0
+#define HL_ST_UNK 0xff
+/* In a C block comment. */
+#define HL_C_CMT 1
+/* In a shell single- and double-quoted string. */
+#define HL_SH_SQ 1
+#define HL_SH_DQ 2
+/*
+ * In a YAML block scalar, the rest bits are the indentation of the
+ * line it has started at.
+ */
+#define HL_YAML_BLK 0x80
+#define HL_YAML_IND_MAX 0x7e
+/* The index of shell in `hl_langs'. */
+#define HL_SH_IDX 1
+/* Keywords of the languages, every one is followed by a space. */
+#define HL_C_KW								\
+	"auto break case char const continue default do double else "	\
+	"enum extern float for goto if inline int long register "	\
+	"restrict return short signed sizeof static struct switch "	\
+	"typedef union unsigned void volatile while bool true false "	\
+	"class namespace template typename public private protected "	\
+	"virtual new delete this nullptr using try catch throw "
+#define HL_SH_KW							\
+	"if then else elif fi case esac for while until do done in "	\
+	"function select time return local export readonly "
+#define HL_YAML_KW "true false yes no on off null ~ "
+#define HL_LOG_ERR							\
+	"error err fatal crit critical panic emerg alert fail failed "	\
+	"failure "
+#define HL_LOG_WARN "warn warning "
+#define HL_LOG_INFO "info notice debug trace "
+
+/* Put the attribute `A' for the bytes [`F', `T') in `AT' (if any). */
+#define HL_PUT(AT, F, T, A) do {		\
+	if ((AT) != NULL)			\
+		memset((AT)+(F), (A), (T)-(F));	\
+} while (0)
+/* Is the line `I' drawn with syntax highlighting. */
+#define HL_IS_ON(I) \
+	(hl_lang != NULL && hl_on && lns[(I)]->l <= HL_LN_MAX)
+/* The lexer state the line `I' starts in. */
+#define HL_ST(I) ((I) == 0 ? HL_ST_NONE : lns[(I)-1]->hl_st)
+/*
+ * The number of rows a line takes with the soft wrap, if its last
+ * column (after its end) is `E' (see `wr_bld').
+ */
+#define WR_ROWS(E) ((E) == 0 ? 1 : ((E)-1) / wrap_w + 1)
+/* Are there lines that are not shown: folded or filtered out. */
+#define HID_ANY (fd_l != 0 || fl_l != 0)
+/*
+ * Are the lines mapped to the screen rows through the tree `wr_fw':
+ * with the soft wrap, or if some of them are not shown.
+ */
+#define WR_MAP (wrap || HID_ANY)
+/* Is the line `I' left out by the filter (see `fl_ln'). */
+#define FL_OUT(I) (fl_l != 0 && fl_ln(I))
+/* Is the line `I' not shown. */
+#define LN_HID(I) (lns[(I)]->fd_hid || FL_OUT(I))
+/* The number of rows the line `I' takes (see `wr_fw'). */
+#define WR_LN(I) (LN_HID(I) ? 0 : !wrap ? 1 : WR_ROWS(lns[(I)]->wr_end))
+/* The tree `wr_fw' is to be built anew from the line `I' on. */
+#define WR_MV(I) do {		\
+	if (wr_mv > (I))	\
+		wr_mv = (I);	\
+} while(0)
+/* The lines from `I' on are to be lexed again (see `hl_sync'). */
+#define HL_FROM(I) do {		\
+	if (hl_l > (I))		\
+		hl_l = (I);	\
+} while (0)
+
+/*
+ * Index in the screen (see `scr_nw') of the cell at row `R' and column
+ * `C' of the part of it that the virtual cursor is in (see `scr_y0').
+ */
+#define SCR_IDX(R, C) \
+	((size_t)(scr_y0 + (R)-1) * scr_cols + scr_x0 + (C)-1)
+/* Index of the virtual cursor cell in the screen. */
+#define VC_IDX() SCR_IDX(vc_y, CLAMP_MAX(vc_x, scr_w+1))
+/* Index of the cell following the last one of the virtual cursor row. */
+#define VC_ROW_END() SCR_IDX(vc_y, scr_w+1)
+
 /*
- * Write argument (as arguments for `dprintf') in reverse video mode
- * and then exit it (mode).
+ * Write `L' bytes of string `S' in reverse video mode and then exit
+ * it (mode).
  */
-#define WR_REV_VID(...) do {			\
-	dprintf(STDOUT_FILENO, REV_VID_CMD);	\
-	dprintf(STDOUT_FILENO, __VA_ARGS__);	\
-	dprintf(STDOUT_FILENO, VID_RST_CMD);	\
+#define WR_REV_VID(S, L) do {		\
+	scr_at(AT_REV);			\
+	scr_wr((S), (L));		\
+	scr_at(0);			\
 } while (0)
 
-#define MV_CURS(R, C) do {				\
-	dprintf(STDOUT_FILENO, MV_CURS_CMD, R, C);	\
-	curs_x = C;					\
-	curs_y = R;					\
+#define MV_CURS(R, C) do {	\
+	scr_mv(R, C);		\
+	curs_x = C;		\
+	curs_y = R;		\
 } while (0)
 
 /*
  * Set terminal cursor to `curs_y' and `curs_x' which are set,
  * _before_ this macro call.
  */
-#define SYNC_CURS() dprintf(STDOUT_FILENO, MV_CURS_CMD, curs_y, curs_x)
+#define SYNC_CURS() scr_mv(curs_y, curs_x)
 
 /* Move cursor right `C' columns. */
 #define MV_CURS_R(C) do {	\
@@ -140,12 +496,6 @@ typedef unsigned short US;
 	SYNC_CURS();		\
 } while (0)
 
-/* Move cursor `C' columns left. */
-#define MV_CURS_L(C) do {	\
-	curs_x -= C;		\
-	SYNC_CURS();\
-} while (0)
-
 /*
  * Move cursor safely: remember current cursor position before
  * changing it.  The further manual call of `RST_CURS' is expected.
@@ -161,15 +511,15 @@ typedef unsigned short US;
  */
 #define RST_CURS() MV_CURS(prev_curs_y, prev_curs_x)
 
-#define ERS_ALL() dprintf(STDOUT_FILENO, ERS_ALL_CMD)
-#define ERS_FWD() dprintf(STDOUT_FILENO, ERS_FWD_CMD)
-#define ERS_LINE_ALL() dprintf(STDOUT_FILENO, ERS_LINE_ALL_CMD)
-#define ERS_LINE_FWD() dprintf(STDOUT_FILENO, ERS_LINE_FWD_CMD)
+#define ERS_ALL() scr_blank(0, scr_rows * scr_cols)
+#define ERS_FWD() scr_ers_fwd()
+#define ERS_LINE_ALL() scr_blank(SCR_IDX(vc_y, 1), VC_ROW_END())
+#define ERS_LINE_FWD() scr_blank(VC_IDX(), VC_ROW_END())
 
 /*
  * Actual current position within `lns'.  See `ln_x', `ln_y'.
  */
-#define LN_X (off_x + ln_x)
+#define LN_X (ln_x)
 #define LN_Y (off_y + ln_y)
 
 /* Clamp value `A' to `M', if `A' greater than `M'. */
@@ -179,9 +529,9 @@ typedef unsigned short US;
  * Put a _printable_ character into screen and move cursor one
  * character right.
  */
-#define PRINT_CHAR(S) do {		\
-	dprintf(STDOUT_FILENO, S);	\
-	MV_CURS_R(1);			\
+#define PRINT_CHAR(S) do {	\
+	scr_str(S);		\
+	MV_CURS_R(1);		\
 } while (0)
 
 /* Move cursor to the ``CMD'' prompt. */
@@ -202,13 +552,42 @@ typedef unsigned short US;
 #define IS_MARK(C) ((C >= 'A' && C <= 'Z') || (C >= 'a' && C <= 'z'))
 /* Is `C' a printable character. */
 #define IS_PRINTABLE(C) ((C) >= ' ' && (C) <= '~')
+/* Is `C' a byte that continues a UTF-8 sequence. */
+#define IS_U8_CONT(C) (((unsigned char)(C) & 0xc0) == 0x80)
 
 /* Free structure and string for line at index `I'. */
 #define FREE_LN(I) do {		\
 	free(lns[(I)]->str);	\
+	free(lns[(I)]->ck);	\
+	free(lns[(I)]->ma);	\
 	free(lns[(I)]);		\
 } while (0)
 
+/*
+ * Let the line at index `I' know that it has been changed from its
+ * byte `X' on.  As a UTF-8 sequence is decoded by looking a few bytes
+ * ahead, the checkpoints that close to `X' are gone too.
+ */
+#define TOUCH_LN(I, X) do {						\
+	while (lns[(I)]->ck_l != 0 &&					\
+	    lns[(I)]->ck[lns[(I)]->ck_l-1].x + UTF8_MAX > (X))		\
+		lns[(I)]->ck_l--;					\
+	lns[(I)]->ascii = -1;						\
+	lns[(I)]->hl_new = 1;						\
+	HL_FROM(I);							\
+	lns[(I)]->ma_gen = 0;						\
+	lns[(I)]->fl_gen = 0;						\
+	lns[(I)]->wr_new = 1;						\
+	if (wr_lo > (I))						\
+		wr_lo = (I);						\
+	if (wr_hi < (I))						\
+		wr_hi = (I);						\
+	if (vw_lo > (I))						\
+		vw_lo = (I);						\
+	if (vw_hi < (I))						\
+		vw_hi = (I);						\
+} while (0)
+
 /* `dpl_pg' with offset of 0. */
 #define DPL_PG() dpl_pg(0)
 
@@ -219,15 +598,319 @@ struct ln {
 	size_t	l;
 	size_t	sz;
 	char	mark;
+	/*
+	 * Column checkpoints: `ck[i]' is the first character at or
+	 * after the byte `(i+1) * CK_STEP' and its column.  Only the
+	 * first `ck_l' of them are known, the rest are found out when
+	 * needed (see `ln_ck').
+	 */
+	struct ckpt*	ck;
+	size_t		ck_l;
+	size_t		ck_sz;
+	/*
+	 * Whether the line is all ASCII: `1' or `0', and `-1' if it
+	 * is not known yet (see `ln_ascii').
+	 */
+	char		ascii;
+	/*
+	 * The lexer state at the end of the line (see `hl_sync'), and
+	 * whether the line has changed since it was found out.
+	 */
+	unsigned char	hl_st;
+	char		hl_new;
+	/*
+	 * The last column of the line (the one after its end), which
+	 * tells how many rows it takes with the soft wrap (see `wr_bld'),
+	 * and whether it has changed since it was found out.
+	 */
+	size_t		wr_end;
+	char		wr_new;
+	/*
+	 * The offsets of the search matches in the line (`ma_l' of
+	 * them), for the pattern of the generation `ma_gen' (see
+	 * `ma_ln').  The generation of `0' means they're not known.
+	 */
+	size_t*		ma;
+	size_t		ma_l;
+	size_t		ma_sz;
+	unsigned long	ma_gen;
+	/*
+	 * The number of lines folded under this one (see `fd_mk'), and
+	 * whether it is one of such lines itself, i.e. it is not shown.
+	 */
+	size_t		fd_n;
+	char		fd_hid;
+	/*
+	 * Whether the filter leaves the line out, for the filter of the
+	 * generation `fl_gen' (see `fl_ln').  `0' means it's not known.
+	 */
+	char		fl_out;
+	unsigned long	fl_gen;
+};
+
+/* A column checkpoint of a line: its character `x' is at `col'. */
+struct ckpt {
+	size_t	x;
+	size_t	col;
+};
+
+/*
+ * A view of the text: a part of the screen with its own viewport.
+ * All the views show the same lines.  The viewport of the view being
+ * worked in is kept in the globals (`off_y', `ln_y', `curs_y' and so
+ * on), and it is saved here when another one is switched to (see
+ * `vw_st' and `vw_ld').
+ */
+struct vw {
+	/*
+	 * The first row and column of its part of the screen (counting
+	 * from 0) and its size, with the status line at the bottom.
+	 * The views side by side are parted by a column of `VW_SEP'.
+	 */
+	US	y0;
+	US	x0;
+	US	rows;
+	US	cols;
+	size_t	off_y;
+	size_t	off_x;
+	size_t	ln_x;
+	size_t	ln_y;
+	US	curs_y;
+	US	curs_x;
+	US	nav_curs_y;
+	US	nav_curs_x;
+	size_t	off_r;
+	size_t	wr_top_ln;
+};
+
+/* A language for syntax highlighting (see `hl_langs'). */
+struct hl_lang {
+	/* Filename suffixes, every one is followed by a space. */
+	const char*	sfx;
+	/* The lexer, see `hl_c'. */
+	unsigned char	(*lex)(const char*, size_t, unsigned char,
+			    unsigned char*);
+};
+
+
+/*
+ * A share of `lns' that is written to the file by one thread.
+ * See `wr_thr'.
+ */
+struct wr_job {
+	int	fd;
+	/* Lines [`from', `to') are written at the file offset `off'. */
+	size_t	from;
+	size_t	to;
+	off_t	off;
+	/*
+	 * Whether it goes through the io_uring(7) engine, if it is there
+	 * (see `ur_wr_lns').
+	 */
+	char	ur;
+	/* errno(2) value if writing failed, `0' otherwise. */
+	int	err;
+};
+
+/*
+ * A share of `lns' that the filter is run over by one thread.
+ * See `fl_thr'.
+ */
+struct fl_job {
+	size_t	from;
+	size_t	to;
+	/* The number of the lines that match. */
+	size_t	n;
+	/* Whether it's been given to a thread of its own. */
+	char	thr;
+};
+
+/*
+ * An event source of the main loop: its descriptor, ready for reading,
+ * is handed to `fn' (see `ev_wait').
+ */
+struct ev {
+	int	fd;
+	void	(*fn)(int);
+};
+
+/* A keyboard macro: the keys as they have come from the terminal. */
+struct mc {
+	char*	s;
+	size_t	l;
+	size_t	sz;
+};
+
+/* Work a thread has handed to the main one, see `ev_post'. */
+struct ev_job {
+	void	(*fn)(void*);
+	void*	arg;
 };
 
 
+#ifdef HAVE_URING
+/*
+ * The io_uring(7) instance: the submission and completion queues
+ * shared with the kernel.  See `ur_init'.
+ */
+struct uring {
+	int			fd;
+	unsigned*		sq_head;
+	unsigned*		sq_tail;
+	unsigned*		sq_mask;
+	unsigned*		sq_arr;
+	struct io_uring_sqe*	sqes;
+	unsigned*		cq_head;
+	unsigned*		cq_tail;
+	unsigned*		cq_mask;
+	struct io_uring_cqe*	cqes;
+	/* Number of queued requests that the kernel doesn't know yet. */
+	unsigned		pend;
+	void*			sq_map;
+	size_t			sq_map_sz;
+	void*			cq_map;
+	size_t			cq_map_sz;
+	size_t			sqes_sz;
+};
+#endif
+
+
 /* Input/output buffer. */
 char buf[IOBUF];
+/*
+ * User input that has been read but not handled yet: `in_l' bytes
+ * from `in_x' on.  It's read in bursts of up to `IOBUF' bytes (see
+ * `rd_in').
+ */
+char in_buf[IOBUF];
+size_t in_x;
+size_t in_l;
+/*
+ * What the main loop waits for besides the user input (see `ev_wait'),
+ * and the descriptors the other threads wake it up through (both are
+ * the same eventfd(2) on Linux).
+ */
+struct ev evs[EV_MAX];
+size_t evs_l;
+int ev_wk_rd;
+int ev_wk_wr;
+/* The work handed to the main thread (see `ev_post') and its lock. */
+struct ev_job* ev_jobs;
+size_t ev_jobs_l;
+size_t ev_jobs_sz;
+pthread_mutex_t ev_mtx = PTHREAD_MUTEX_INITIALIZER;
+#ifndef HAVE_EVFD
+/* The pipe a signal is passed through to the main loop. */
+int ev_sig_pp[2];
+#endif
+/*
+ * The timer the window resize waits for (`-1' if there are no timers),
+ * and whether it's running (see `rd_sigwinch').
+ */
+int rsz_tm = -1;
+char rsz_pend;
+/*
+ * The keyboard macros, the register being recorded into (`0' if none)
+ * and where in it the last command has begun (see `do_macro').
+ */
+struct mc mcs[MC_N];
+char mc_rec;
+size_t mc_cmd_x;
+/*
+ * Is a macro being played, which one, how far it has got and how many
+ * more times it's put into `in_buf' (see `mc_fill').  The input that
+ * came with the command that started it is handled after it.
+ */
+char mc_on;
+struct mc* mc_pl;
+size_t mc_x;
+size_t mc_n;
+char mc_ta[IOBUF];
+size_t mc_ta_l;
+/*
+ * Frame buffer: everything we send to the terminal is collected here
+ * and written out at once by `ob_flush'.  See `ob_wr'.
+ */
+char* obuf;
+/* Length of the frame in `obuf' and the size of `obuf'. */
+size_t obuf_l;
+size_t obuf_sz;
+/*
+ * How much of the frame in `obuf' the terminal has already taken.
+ * While it hasn't taken it all, no new frame is made (see `scr_flush').
+ */
+size_t obuf_off;
+/*
+ * The terminal, opened once again for non-blocking output (see
+ * `setup_terminal').  It's a file descriptor of its own, so we don't
+ * make standard input non-blocking too.
+ */
+int out_fd = STDOUT_FILENO;
+/* Does the terminal support synchronized update (see `query_term'). */
+char sync_upd;
+
+/*
+ * Shadow screen.  Nothing is drawn on the terminal directly: it is
+ * drawn on the new screen `scr_nw' instead, while the old screen
+ * `scr_ol' keeps what the terminal shows.  Only cells that differ
+ * between the two are sent to the terminal (see `scr_flush').
+ * --
+ * Both are `scr_rows' rows of `scr_cols' cells each, the size of the
+ * terminal: the views of the text (see `struct vw') and the ``CMD''
+ * line, which is the status line of the bottom view as well.
+ */
+CELL* scr_nw;
+CELL* scr_ol;
+US scr_rows;
+US scr_cols;
+/* Is the terminal screen to be cleared before the next update. */
+char scr_clr;
+/*
+ * Virtual cursor: the position (row and column, counting from 1) and
+ * the attributes of what is drawn next on the new screen.
+ */
+US vc_y;
+US vc_x;
+unsigned char vc_at;
+/*
+ * The part of the screen the virtual cursor is in, and counts its
+ * position from: the first row and column of it (counting from 0)
+ * and its size.  It is either the view being worked in or the ``CMD''
+ * line (see `scr_mv').
+ */
+US scr_y0;
+US scr_x0;
+US scr_h;
+US scr_w;
+/*
+ * The terminal cursor position and attributes, as far as we know them.
+ * A position of `0' means that we don't know it.
+ */
+US tc_y;
+US tc_x;
+unsigned char tc_at;
+/* The rows of the terminal scrolling region (`0' if it is not set). */
+US tc_rgn_top;
+US tc_rgn_bot;
+/* Capabilities of the terminal (`TC_*'), see `rd_tinfo'. */
+int tcap;
+/*
+ * What the keys send after `ESC', as the terminfo(5) entry says (see
+ * `rd_tinfo').  Indexed by `KEY_*'; empty for the unknown ones.
+ */
+char tkey[KEY_N][TKEY_MAX];
+/* How long (in ms) do we wait for an escape sequence after `ESC'. */
+int esc_delay;
+/*
+ * Hashes of the rows of the new and old screens, used to find out if
+ * the screen has been scrolled (see `scr_scrl_find').
+ */
+unsigned long* scr_hnw;
+unsigned long* scr_hol;
 /* Buffer for user commands.  Filled by `read_cmd'. */
 char cmd[IOBUF];
 char fnd[IOBUF];
-int fnd_i, prev_fnd_i;
+int fnd_i;
 char flg;
 char sub[IOBUF];
 int sub_i;
@@ -267,14 +950,23 @@ struct termios tos;
 char mod;
 /* If we're in search move (found some matches and can navigate). */
 char in_sea;
-US ln_x_tmp;
-US ln_y_tmp;
+size_t ln_x_tmp;
+size_t ln_y_tmp;
 US curs_x_tmp;
 US curs_y_tmp;
 /* Line with match. */
 size_t mat_i;
 /* Math offset (within the string `mat_i'). */
 size_t mat_off;
+/*
+ * The search pattern (and whether its case is ignored) the matches in
+ * the lines are cached for, and its generation: it's a new one every
+ * time the pattern changes (see `ma_ln').
+ */
+char ma_fnd[IOBUF];
+int ma_fnd_i = -1;
+char ma_i_flag;
+unsigned long ma_gen;
 
 /*
  * Terminal cursor position (row and column).
@@ -298,26 +990,47 @@ US nav_curs_x;
 US nav_curs_y;
 
 /*
- * Number of terminal window rows and columns.
+ * Number of text rows and columns of the view being worked in (the
+ * status line is below them), and where it is on the screen.
  */
 US ws_row;
 US ws_col;
+US vw_y0;
+US vw_x0;
+
+/*
+ * The views the screen is split into, the one being worked in, and
+ * is it another one that is being drawn now (see `vw_dpl').
+ */
+struct vw vws[VW_MAX];
+int vws_l = 1;
+int vw_cur;
+char vw_oth;
+/*
+ * The lines [`vw_lo', `vw_hi'] have been changed since the other
+ * views were brought up to date (see `vw_upd').
+ */
+size_t vw_lo = (size_t)-1;
+size_t vw_hi;
 
 /*
  * Current line index (`ln_y') and current offset within its string (`ln_x').
- * These values are in range [0, `ws_row'-1] (`ln_y') and [0, `ws_col'-1]
- * (`ln_x').  Thus, they are limited to the screen.  To get actual offsets
- * within the `lns', use `LN_X' and `LN_Y'.
+ * The line index is in range [0, `ws_row'-1], i.e. it is limited to the
+ * screen (unless there are folded lines between, see `fd_mk'), while
+ * the offset is not (lines may be wider than the screen, see `off_x').
+ * To get actual offsets within the `lns', use `LN_X' and `LN_Y'.
  */
-US ln_x;
-US ln_y;
+size_t ln_x;
+size_t ln_y;
 
 /*
  * Horizontal and vertical offsets of a lines in the screen.
- * They are used to compute `LN_X' and `LN_Y'.
  * --
  * Example: `off_y' of 5 means that the first (topmost) line
- * we see on the screen is `lns[5]' line.
+ * we see on the screen is `lns[5]' line.  `off_x' of 16 means
+ * that the first 16 columns of every line are scrolled off the
+ * left edge of the screen.  It is always a multiple of `TABSIZE',
+ * so tabs are drawn the same way they would be without it.
  */
 size_t off_x;
 size_t off_y;
@@ -331,6 +1044,92 @@ char dirty;
  */
 char need_print_pos;
 
+/*
+ * Bytes of a UTF-8 character that is being typed in, they
+ * come one by one.
+ */
+char u8_in[UTF8_MAX];
+size_t u8_in_l;
+
+/*
+ * Syntax highlighting: the language of the buffer (`NULL' if it has
+ * none, see `hl_detect') and whether it is on (see `do_hl').
+ */
+const struct hl_lang* hl_lang;
+char hl_on = 1;
+/* The lines before this one have their `hl_st' up to date. */
+size_t hl_l;
+/* The first line that has been drawn in a wrong start state. */
+size_t hl_chg = (size_t)-1;
+/* Attributes of the bytes of the line being drawn. */
+unsigned char hl_at[HL_LN_MAX];
+
+/*
+ * Soft wrap: is it on (see `do_wrap'), and the width of the rows the
+ * lines are wrapped at.  It is a multiple of `TABSIZE', so every row
+ * is drawn just as the line with the horizontal offset would be.
+ */
+char wrap;
+size_t wrap_w;
+/*
+ * The first rows of the line `off_y' that are above the screen with
+ * the soft wrap, and what `off_y' was when it was set (see `wr_fix').
+ */
+size_t off_r;
+size_t wr_top_ln;
+/*
+ * A Fenwick tree over the number of rows of every line with the soft
+ * wrap: `wr_fw[i]' is the sum for the lines (`i' - (`i' & -`i'), `i'].
+ * It has `wr_fw_l' lines, and room for `wr_fw_sz' - 1 of them.
+ */
+size_t* wr_fw;
+size_t wr_fw_l;
+size_t wr_fw_sz;
+/*
+ * The lines [`wr_lo', `wr_hi'] have been changed since the tree was
+ * updated, and the lines from `wr_mv' on have been moved by inserting
+ * or removing lines (or the tree is to be built anew from there).
+ */
+size_t wr_lo = (size_t)-1;
+size_t wr_hi;
+size_t wr_mv = (size_t)-1;
+/*
+ * The soft wrapped screen is to be redrawn, centered, or put so that
+ * the cursor is at its bottom (see `wr_fix').
+ */
+char wr_dpl;
+char wr_ctr;
+char wr_bot;
+/*
+ * The cursor line after `wr_fix', it tells which way the cursor has
+ * gone since.
+ */
+size_t wr_ln;
+
+/* The number of the folds (see `fd_mk'). */
+size_t fd_l;
+/*
+ * The filter: only the lines that have `fl_pat' in them are shown
+ * (see `do_filter'), unless its length `fl_l' is `0'.  Every time it
+ * is set, it gets a new generation `fl_gen'.
+ */
+char fl_pat[IOBUF];
+size_t fl_l;
+unsigned long fl_gen;
+/*
+ * The filter being looked for in the background (see `fl_scan'): its
+ * pattern `fl_new_l' bytes long, whether each line is left out by it
+ * (`fl_res'), and how many lines are not.  While `fl_busy' is set, the
+ * text is not changed (see `fl_wait').
+ */
+char fl_new[IOBUF];
+size_t fl_new_l;
+char* fl_res;
+size_t fl_res_sz;
+size_t fl_n;
+pthread_t fl_tid;
+char fl_busy;
+
 
 /*
  * This is an implementation of strnstr(3), which is
@@ -441,335 +1240,3372 @@ scalloc(size_t n, size_t size)
 }
 
 /*
- * Free `lns', every `ln' and `ln->str' within it.
+ * Get the length of the UTF-8 sequence that starts with the byte `c',
+ * or `0' if it can't start one.
  */
-void
-free_lns()
+size_t
+u8_len(unsigned char c)
+{
+	if (c < 0x80)
+		return 1;
+	if (c < 0xc2)
+		return 0;
+	if (c < 0xe0)
+		return 2;
+	if (c < 0xf0)
+		return 3;
+	if (c < 0xf5)
+		return 4;
+	return 0;
+}
+
+/*
+ * Decode the UTF-8 character at `s' (that has `n' bytes at most) into
+ * `cp' and return its length.  A byte that doesn't start a valid
+ * sequence is taken as a one-byte character with the code point `-1'.
+ */
+size_t
+u8_dec(const char* s, size_t n, long* cp)
 {
+	const unsigned char* u;
+	size_t l;
 	size_t i;
 	
-	for (i = 0; i < lns_l; ++i)
-		FREE_LN(i);
-	
-	free(lns);
+	u = (const unsigned char*)s;
+	l = u8_len(*u);
+	if (l == 1) {
+		*cp = *u;
+		return 1;
+	}
+	if (l == 0 || l > n)
+		goto inval;
+	
+	*cp = *u & (0x7f >> l);
+	for (i = 1; i < l; ++i) {
+		if (!IS_U8_CONT(u[i]))
+			goto inval;
+		*cp = *cp << 6 | (u[i] & 0x3f);
+	}
+	/* Overlong sequences, surrogates and what's beyond Unicode. */
+	if ((l == 3 && *cp < 0x800) || (l == 4 && *cp < 0x10000) ||
+	    (*cp >= 0xd800 && *cp <= 0xdfff) || *cp > 0x10ffff)
+		goto inval;
+	return l;
+inval:
+	*cp = -1;
+	return 1;
 }
 
 /*
- * Free all global pointers.
+ * Encode the code point `cp' in UTF-8 at `s' and return its length.
  */
-void
-free_all()
+size_t
+u8_enc(long cp, char* s)
 {
-	free_lns();
-	free(filepath);
-	free(cmd_txt);
+	if (cp < 0x80) {
+		s[0] = cp;
+		return 1;
+	}
+	if (cp < 0x800) {
+		s[0] = 0xc0 | cp >> 6;
+		s[1] = 0x80 | (cp & 0x3f);
+		return 2;
+	}
+	if (cp < 0x10000) {
+		s[0] = 0xe0 | cp >> 12;
+		s[1] = 0x80 | (cp >> 6 & 0x3f);
+		s[2] = 0x80 | (cp & 0x3f);
+		return 3;
+	}
+	s[0] = 0xf0 | cp >> 18;
+	s[1] = 0x80 | (cp >> 12 & 0x3f);
+	s[2] = 0x80 | (cp >> 6 & 0x3f);
+	s[3] = 0x80 | (cp & 0x3f);
+	return 4;
 }
 
 /*
- * Terminate the program: free all the data, return to the
- * canonical terminal mode and exit.
+ * Is `cp' within one of `n' sorted ranges `rng'.
  */
-void
-terminate()
+char
+in_rng(long cp, const long rng[][2], size_t n)
 {
-	free_all();
-	/*
-	 * Restore original terminal settings.
-	 * --
-	 * `TCSANOW' flag is for changes to be applied immediately.
-	 */
-	if (tcsetattr(STDOUT_FILENO, TCSANOW, &orig_tos) == -1)
-		err(1, "Can not restore original terminal attributes");
-	exit(0);
+	size_t lo;
+	size_t hi;
+	size_t mid;
+	
+	lo = 0;
+	hi = n;
+	while (lo < hi) {
+		mid = lo + (hi-lo) / 2;
+		if (cp > rng[mid][1])
+			lo = mid+1;
+		else if (cp < rng[mid][0])
+			hi = mid;
+		else
+			return 1;
+	}
+	return 0;
 }
 
 /*
- * Set raw (non-canonical) terminal mode.
- * See termios(4).
+ * How many columns does the character `cp' take on the screen: `0'
+ * for combining marks and other invisible ones, `2' for East Asian
+ * wide and fullwidth ones and `1' for the rest.  Invalid and control
+ * characters are shown as `?' (see `scr_wr'), so they take one.
+ */
+int
+cp_wid(long cp)
+{
+	static const long zero[][2] = {
+		{ 0x0300, 0x036f }, { 0x0483, 0x0489 }, { 0x0591, 0x05bd },
+		{ 0x05bf, 0x05bf }, { 0x05c1, 0x05c2 }, { 0x05c4, 0x05c5 },
+		{ 0x05c7, 0x05c7 }, { 0x0610, 0x061a }, { 0x064b, 0x065f },
+		{ 0x0670, 0x0670 }, { 0x06d6, 0x06dc }, { 0x06df, 0x06e4 },
+		{ 0x06e7, 0x06e8 }, { 0x06ea, 0x06ed }, { 0x0e31, 0x0e31 },
+		{ 0x0e34, 0x0e3a }, { 0x0e47, 0x0e4e }, { 0x1ab0, 0x1aff },
+		{ 0x1dc0, 0x1dff }, { 0x200b, 0x200f }, { 0x202a, 0x202e },
+		{ 0x2060, 0x2064 }, { 0x20d0, 0x20ff }, { 0xfe00, 0xfe0f },
+		{ 0xfe20, 0xfe2f }, { 0xfeff, 0xfeff }, { 0xe0100, 0xe01ef }
+	};
+	static const long wide[][2] = {
+		{ 0x1100, 0x115f }, { 0x231a, 0x231b }, { 0x2329, 0x232a },
+		{ 0x23e9, 0x23ec }, { 0x23f0, 0x23f0 }, { 0x23f3, 0x23f3 },
+		{ 0x25fd, 0x25fe }, { 0x2614, 0x2615 }, { 0x2648, 0x2653 },
+		{ 0x267f, 0x267f }, { 0x2693, 0x2693 }, { 0x26a1, 0x26a1 },
+		{ 0x26aa, 0x26ab }, { 0x26bd, 0x26be }, { 0x26c4, 0x26c5 },
+		{ 0x26ce, 0x26ce }, { 0x26d4, 0x26d4 }, { 0x26ea, 0x26ea },
+		{ 0x26f2, 0x26f3 }, { 0x26f5, 0x26f5 }, { 0x26fa, 0x26fa },
+		{ 0x26fd, 0x26fd }, { 0x2705, 0x2705 }, { 0x270a, 0x270b },
+		{ 0x2728, 0x2728 }, { 0x274c, 0x274c }, { 0x274e, 0x274e },
+		{ 0x2753, 0x2755 }, { 0x2757, 0x2757 }, { 0x2795, 0x2797 },
+		{ 0x27b0, 0x27b0 }, { 0x27bf, 0x27bf }, { 0x2b1b, 0x2b1c },
+		{ 0x2b50, 0x2b50 }, { 0x2b55, 0x2b55 }, { 0x2e80, 0x303e },
+		{ 0x3041, 0x33ff }, { 0x3400, 0x4dbf }, { 0x4e00, 0x9fff },
+		{ 0xa000, 0xa4cf }, { 0xa960, 0xa97f }, { 0xac00, 0xd7a3 },
+		{ 0xf900, 0xfaff }, { 0xfe10, 0xfe19 }, { 0xfe30, 0xfe6f },
+		{ 0xff00, 0xff60 }, { 0xffe0, 0xffe6 }, { 0x1f300, 0x1f64f },
+		{ 0x1f900, 0x1f9ff }, { 0x20000, 0x2fffd }, { 0x30000, 0x3fffd }
+	};
+	
+	if (cp < 0x300)
+		return 1;
+	if (in_rng(cp, zero, sizeof(zero)/sizeof(*zero)))
+		return 0;
+	if (in_rng(cp, wide, sizeof(wide)/sizeof(*wide)))
+		return 2;
+	return 1;
+}
+
+/*
+ * Are all `n' bytes at `s' ASCII.
  * --
- * It is important to save the terminal's current settings into memory
- * _before_ we alter them, to restore them after editor's closed.
+ * It looks at a machine word at a time: the compiler makes it even
+ * wider, where it can.
  */
-void
-set_raw()
+char
+is_ascii(const char* s, size_t n)
 {
-	/* Save current settings in `tos'. */
-	if (tcgetattr(STDOUT_FILENO, &tos) == -1)
-		err(1, "Can not get terminal attributes");
+	uint64_t w;
+	uint64_t acc;
+	size_t i;
 	
-	/* Save (copy) current settings to be able to restore them later. */
-	orig_tos = tos;
+	for (acc = 0; n >= 64; s += 64, n -= 64) {
+		for (i = 0; i < 64; i += 8) {
+			memcpy(&w, s+i, 8);
+			acc |= w;
+		}
+		if (acc & 0x8080808080808080ULL)
+			return 0;
+	}
+	for (; n >= 8; s += 8, n -= 8) {
+		memcpy(&w, s, 8);
+		acc |= w;
+	}
+	for (; n > 0; ++s, --n)
+		acc |= (unsigned char)*s;
+	return !(acc & 0x8080808080808080ULL);
+}
+
+/*
+ * Append `n' bytes at `s' to the frame buffer `obuf'.
+ * --
+ * If the terminal supports it, every frame starts with the begin of
+ * synchronized update, so it is shown at once (see `ob_flush').
+ */
+void
+ob_wr(const char* s, size_t n)
+{
+	if (obuf_l == 0 && sync_upd) {
+		obuf_l = sizeof(BSU_CMD)-1;
+		ob_wr(s, n);
+		memcpy(obuf, BSU_CMD, sizeof(BSU_CMD)-1);
+		return;
+	}
+	
+	if (obuf_l + n > obuf_sz) {
+		while (obuf_l + n > obuf_sz)
+			obuf_sz = obuf_sz == 0 ? OBUF : obuf_sz*2;
+		obuf = srealloc(obuf, obuf_sz);
+	}
+	memcpy(obuf+obuf_l, s, n);
+	obuf_l += n;
+}
+
+/*
+ * Append a NUL-terminated string `s' to the frame buffer.
+ */
+void
+ob_str(const char* s)
+{
+	ob_wr(s, strlen(s));
+}
+
+/*
+ * Append the decimal representation of `n' to the frame buffer.
+ * --
+ * It's what all the escape sequences and the status line are made
+ * of, so we don't want to parse format strings to print it.
+ */
+void
+ob_num(size_t n)
+{
+	char s[24];
+	char* p;
+	
+	p = s + sizeof(s);
+	do {
+		*--p = '0' + n % 10;
+		n /= 10;
+	} while (n != 0);
+	ob_wr(p, s + sizeof(s) - p);
+}
+
+/*
+ * Append `n' spaces to the frame buffer.
+ */
+void
+ob_pad(size_t n)
+{
+	static const char sp[] = "                ";
+	
+	for (; n > sizeof(sp)-1; n -= sizeof(sp)-1)
+		ob_wr(sp, sizeof(sp)-1);
+	ob_wr(sp, n);
+}
+
+/*
+ * Get the number of decimal digits of `n'.
+ */
+size_t
+ndigits(size_t n)
+{
+	size_t d;
+	
+	for (d = 1; n >= 10; n /= 10)
+		++d;
+	return d;
+}
+
+/*
+ * Append a command `cmd' with the number `n' before it to the frame
+ * buffer (or without it, if it's `1', which is what is meant then).
+ */
+void
+ob_csi(size_t n, const char* cmd)
+{
+	ob_wr(CSI, sizeof(CSI)-1);
+	if (n != 1)
+		ob_num(n);
+	ob_str(cmd);
+}
+
+/*
+ * Move the terminal cursor within the row from the column `from' to
+ * `to' of the row `r', or just get how many bytes it would take if
+ * `emit' is `0'.
+ * --
+ * Going back is done either with backspaces or with a relative move,
+ * going forward is done either with a relative move or by printing
+ * again what the terminal already shows there (see `ob_mv').
+ */
+size_t
+mv_hor(US r, US from, US to, char emit)
+{
+	CELL* row;
+	size_t cost;
+	US i;
+	char c;
+	
+	if (from == to)
+		return 0;
+	
+	if (to < from) {
+		cost = sizeof(CSI)-1 +
+		    (from-to == 1 ? 0 : ndigits(from-to)) + 1;
+		if ((size_t)(from-to) <= cost) {
+			cost = from-to;
+			for (i = 0; emit && i < cost; ++i)
+				ob_wr("\b", 1);
+		}
+		else if (emit)
+			ob_csi(from-to, CUB_CMD);
+		return cost;
+	}
+	
+	cost = sizeof(CSI)-1 + (to-from == 1 ? 0 : ndigits(to-from)) + 1;
+	/*
+	 * The cells are printed again only if they are plain ones with
+	 * the current attributes.
+	 */
+	row = scr_ol + (r-1) * scr_cols;
+	if ((size_t)(to-from) < cost) {
+		for (i = from-1; i < to-1; ++i) {
+			if (CELL_AT(row[i]) != tc_at || CELL_CH(row[i]) < ' ' ||
+			    CELL_CH(row[i]) >= 0x7f)
+				break;
+		}
+		if (i == to-1) {
+			for (i = from-1; emit && i < to-1; ++i) {
+				c = CELL_CH(row[i]);
+				ob_wr(&c, 1);
+			}
+			return to-from;
+		}
+	}
+	if (emit)
+		ob_csi(to-from, CUF_CMD);
+	return cost;
+}
+
+/*
+ * Move the terminal cursor within the column from the row `from' to
+ * `to', or just get how many bytes it would take if `emit' is `0'.
+ * --
+ * Going down by newlines is fine unless they would scroll the region.
+ */
+size_t
+mv_ver(US from, US to, char emit)
+{
+	size_t cost;
+	US bot;
+	US i;
+	
+	if (from == to)
+		return 0;
+	
+	if (to < from) {
+		if (emit)
+			ob_csi(from-to, CUU_CMD);
+		return sizeof(CSI)-1 +
+		    (from-to == 1 ? 0 : ndigits(from-to)) + 1;
+	}
+	
+	cost = sizeof(CSI)-1 + (to-from == 1 ? 0 : ndigits(to-from)) + 1;
+	bot = tc_rgn_top != 0 ? tc_rgn_bot : scr_rows;
+	if ((size_t)(to-from) <= cost && (from > bot || bot >= to)) {
+		cost = to-from;
+		for (i = 0; emit && i < cost; ++i)
+			ob_wr(IND_CMD, sizeof(IND_CMD)-1);
+	}
+	else if (emit)
+		ob_csi(to-from, CUD_CMD);
+	return cost;
+}
+
+/*
+ * Append the command for moving terminal cursor to the row `r' and
+ * column `c' to the frame buffer.
+ * --
+ * If we know where the terminal cursor is, the cheapest of the ways to
+ * get there is chosen: relative moves, carriage return, backspaces,
+ * reprinting the cells in between, or the absolute move.  Nothing is
+ * sent if the cursor is already there.
+ */
+void
+ob_mv(US r, US c)
+{
+	/* The way to move: absolute, relative and from the first column. */
+	enum { MV_ABS, MV_REL, MV_CR } how;
+	size_t best;
+	size_t cost;
+	
+	if (tc_y == r && tc_x == c)
+		return;
+	
+	how = MV_ABS;
+	best = sizeof(CSI)-1 + (r == 1 && c == 1 ? 0 : ndigits(r)) +
+	    (c == 1 ? 0 : 1 + ndigits(c)) + 1;
+	
+	/*
+	 * Relative moves up and down stop at the margins of the scrolling
+	 * region, so they can't be used to get in or out of it.
+	 */
+	if (tc_y != 0 && tc_x != 0 && (tc_rgn_top == 0 ||
+	    (tc_y >= tc_rgn_top && tc_y <= tc_rgn_bot) ==
+	    (r >= tc_rgn_top && r <= tc_rgn_bot))) {
+		cost = mv_ver(tc_y, r, 0);
+		if (cost + mv_hor(r, tc_x, c, 0) < best) {
+			best = cost + mv_hor(r, tc_x, c, 0);
+			how = MV_REL;
+		}
+		if (cost + 1 + mv_hor(r, 1, c, 0) < best)
+			how = MV_CR;
+	}
+	
+	switch (how) {
+	case MV_ABS:
+		ob_wr(CSI, sizeof(CSI)-1);
+		if (r != 1 || c != 1)
+			ob_num(r);
+		if (c != 1) {
+			ob_wr(";", 1);
+			ob_num(c);
+		}
+		ob_str(CUP_CMD);
+		break;
+	case MV_REL:
+		mv_ver(tc_y, r, 1);
+		mv_hor(r, tc_x, c, 1);
+		break;
+	case MV_CR:
+		mv_ver(tc_y, r, 1);
+		ob_wr("\r", 1);
+		mv_hor(r, 1, c, 1);
+		break;
+	}
+	tc_y = r;
+	tc_x = c;
+}
+
+/*
+ * Write the frame collected in `obuf' to the terminal with as few
+ * write(2)s as possible (normally, one).
+ * --
+ * If the terminal is slow to take it, we don't wait for it: what is
+ * left is written by the next calls.  Returns `1' if the whole frame
+ * has been written, `0' otherwise.
+ */
+char
+ob_flush()
+{
+	ssize_t wb;
+	
+	if (obuf_l == 0)
+		return 1;
+	if (obuf_off == 0 && sync_upd)
+		ob_wr(ESU_CMD, sizeof(ESU_CMD)-1);
+	
+	while (obuf_off < obuf_l) {
+		wb = write(out_fd, obuf+obuf_off, obuf_l-obuf_off);
+		if (wb == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			break;
+		}
+		obuf_off += wb;
+	}
+	obuf_l = obuf_off = 0;
+	return 1;
+}
+
+/*
+ * Append the command for switching to attributes `at' to the frame
+ * buffer.
+ */
+void
+ob_at(unsigned char at)
+{
+	ob_wr(SGR_CMD, sizeof(SGR_CMD)-1);
+	if (at & AT_REV)
+		ob_wr(";7", 2);
+	if (at & AT_UL)
+		ob_wr(";4", 2);
+	if (AT_FG_OF(at) != 0) {
+		ob_wr(";", 1);
+		ob_num(30 + AT_FG_OF(at));
+	}
+	ob_wr("m", 1);
+	tc_at = at;
+}
+
+/*
+ * Append the command for setting the terminal scrolling region to the
+ * rows [`top', `bot'] to the frame buffer.  With `top' of `0' the
+ * region is reset to the whole screen.
+ * --
+ * Setting the region moves the cursor home, so we don't know where
+ * it is after that.
+ */
+void
+ob_rgn(US top, US bot)
+{
+	if (top == tc_rgn_top && bot == tc_rgn_bot)
+		return;
+	
+	if (top == 0)
+		ob_str(RGN_RST_CMD);
+	else {
+		ob_wr(CSI, sizeof(CSI)-1);
+		ob_num(top);
+		ob_wr(";", 1);
+		ob_num(bot);
+		ob_str(RGN_CMD);
+	}
+	tc_rgn_top = top;
+	tc_rgn_bot = bot;
+	tc_y = tc_x = 0;
+}
+
+/*
+ * (Re)allocate the shadow screens for the current window size
+ * (`scr_rows' and `scr_cols').  We don't know what the terminal shows
+ * after the window has changed, so it is cleared on the next update.
+ */
+void
+scr_init()
+{
+	size_t i;
+	
+	scr_nw = srealloc(scr_nw, scr_rows * scr_cols * sizeof(CELL) + 1);
+	scr_ol = srealloc(scr_ol, scr_rows * scr_cols * sizeof(CELL) + 1);
+	scr_hnw = srealloc(scr_hnw, scr_rows * sizeof(unsigned long));
+	scr_hol = srealloc(scr_hol, scr_rows * sizeof(unsigned long));
+	for (i = 0; i < (size_t)scr_rows * scr_cols; ++i)
+		scr_nw[i] = scr_ol[i] = BLANK;
+	
+	scr_y0 = scr_x0 = 0;
+	scr_h = scr_rows;
+	scr_w = scr_cols;
+	vc_y = CLAMP_MAX(vc_y, scr_rows);
+	if (vc_y == 0)
+		vc_y = 1;
+	if (vc_x == 0)
+		vc_x = 1;
+	scr_clr = 1;
+}
+
+/*
+ * Move the virtual cursor to row `r' and column `c' of the view being
+ * worked in.  Just like the terminal does, we keep it within the view.
+ * --
+ * The rows below its status line are the ``CMD'' line, which is as
+ * wide as the screen.
+ */
+void
+scr_mv(US r, US c)
+{
+	if (r > ws_row+1) {
+		scr_y0 = scr_rows-1;
+		scr_x0 = 0;
+		scr_h = 1;
+		scr_w = scr_cols;
+		r = 1;
+	}
+	else {
+		scr_y0 = vw_y0;
+		scr_x0 = vw_x0;
+		scr_h = ws_row+1;
+		scr_w = ws_col;
+	}
+	vc_y = r < 1 ? 1 : CLAMP_MAX(r, scr_h);
+	vc_x = c < 1 ? 1 : CLAMP_MAX(c, scr_w);
+}
+
+/*
+ * Set attributes for what is drawn next.
+ */
+void
+scr_at(unsigned char at)
+{
+	vc_at = at;
+}
+
+/*
+ * Before the cells [`from', `to') of the new screen (they are within
+ * a row) are drawn over, make sure no wide character is left there
+ * with one half only: the terminal wouldn't keep the other half.
+ */
+void
+scr_cut(size_t from, size_t to)
+{
+	if (from % scr_cols != 0 && CELL_CH(scr_nw[from]) == WIDE_CONT)
+		scr_nw[from-1] = BLANK;
+	if (to % scr_cols != 0 && to < (size_t)scr_rows * scr_cols &&
+	    CELL_CH(scr_nw[to]) == WIDE_CONT)
+		scr_nw[to] = BLANK;
+}
+
+/*
+ * Erase cells [`from', `to') of the new screen.
+ */
+void
+scr_blank(size_t from, size_t to)
+{
+	scr_cut(from, to);
+	for (; from < to; ++from)
+		scr_nw[from] = BLANK;
+}
+
+/*
+ * Erase the new screen from the virtual cursor to the end of the part
+ * of it that the cursor is in.
+ */
+void
+scr_ers_fwd()
+{
+	US r;
+	
+	scr_blank(VC_IDX(), VC_ROW_END());
+	for (r = vc_y+1; r <= scr_h; ++r)
+		scr_blank(SCR_IDX(r, 1), SCR_IDX(r, scr_w+1));
+}
+
+/*
+ * Draw `n' bytes at `s' on the new screen at the virtual cursor.
+ * --
+ * `\r' and `\n' move the cursor to the first column and to the next
+ * row.  Tabs are expanded up to the next tab stop.  The text that
+ * doesn't fit in the row (of the view) is cut off.  Other control
+ * characters (and invalid UTF-8) are shown as `?', so whatever the text
+ * has, it can't mess the terminal.  Wide characters take two cells, and
+ * zero-width ones are not drawn at all.
+ */
+void
+scr_wr(const char* s, size_t n)
+{
+	CELL* row;
+	/* The index of the row start in `scr_nw'. */
+	size_t ri;
+	long cp;
+	size_t l;
+	int w;
+	
+	ri = SCR_IDX(vc_y, 1);
+	row = scr_nw + ri - 1;
+	for (; n > 0; s += l, n -= l) {
+		l = 1;
+		switch (*s) {
+		case '\r':
+			vc_x = 1;
+			continue;
+		case '\n':
+			if (vc_y < scr_h) {
+				vc_y++;
+				row += scr_cols;
+				ri += scr_cols;
+			}
+			continue;
+		}
+		
+		if (vc_x > scr_w)
+			continue;
+		if (*s == '\t') {
+			w = TABSIZE - (vc_x-1) % TABSIZE;
+			w = CLAMP_MAX(w, scr_w - vc_x + 1);
+			scr_cut(ri + vc_x-1, ri + vc_x-1 + w);
+			for (; w > 0; --w)
+				row[vc_x++] = MK_CELL(' ', vc_at);
+			continue;
+		}
+		
+		if ((unsigned char)*s < 0x80)
+			cp = IS_PRINTABLE(*s) ? *s : '?';
+		else {
+			l = u8_dec(s, n, &cp);
+			if (cp < 0xa0)
+				cp = '?';
+		}
+		if ((w = cp_wid(cp)) == 0)
+			continue;
+		/* A wide character that doesn't fit is cut off too. */
+		if (w == 2 && vc_x == scr_w)
+			cp = ' ';
+		
+		scr_cut(ri + vc_x-1, ri + CLAMP_MAX(vc_x-1 + w, scr_w));
+		row[vc_x++] = MK_CELL(cp, vc_at);
+		if (w == 2 && vc_x <= scr_w)
+			row[vc_x++] = MK_CELL(WIDE_CONT, vc_at);
+	}
+}
+
+/*
+ * Draw a NUL-terminated string `s' on the new screen.
+ */
+void
+scr_str(const char* s)
+{
+	scr_wr(s, strlen(s));
+}
+
+/*
+ * Draw the decimal representation of `n' on the new screen.
+ */
+void
+scr_num(size_t n)
+{
+	char s[24];
+	char* p;
+	
+	p = s + sizeof(s);
+	do {
+		*--p = '0' + n % 10;
+		n /= 10;
+	} while (n != 0);
+	scr_wr(p, s + sizeof(s) - p);
+}
+
+/*
+ * Draw `n' spaces on the new screen.
+ */
+void
+scr_pad(size_t n)
+{
+	for (; n > 0 && vc_x <= scr_w; --n)
+		scr_wr(" ", 1);
+}
+
+/*
+ * Send the cells [`from', `to') of the row `r' of the new screen to
+ * the terminal.
+ * --
+ * Long runs of blanks are erased rather than printed, and long runs
+ * of the same character are printed once and then repeated.
+ */
+void
+scr_put(US r, US from, US to)
+{
+	CELL* row;
+	CELL* ol;
+	/* Length of the run of the same cells. */
+	US n;
+	char c[UTF8_MAX];
+	
+	row = scr_nw + (r-1) * scr_cols;
+	ol = scr_ol + (r-1) * scr_cols;
+	ob_mv(r, from+1);
+	while (from < to) {
+		for (n = 1; from+n < to && row[from+n] == row[from]; ++n)
+			;
+		
+		if (row[from] == BLANK && n >= ECH_MIN && from+n < to &&
+		    (tcap & TC_ECH)) {
+			if (tc_at != 0)
+				ob_at(0);
+			ob_wr(CSI, sizeof(CSI)-1);
+			ob_num(n);
+			ob_str(ECH_CMD);
+			/*
+			 * The old screen is to show what the terminal does,
+			 * as the cursor may be moved by printing it again.
+			 */
+			memcpy(ol+from, row+from, n * sizeof(CELL));
+			from += n;
+			/* Erasing doesn't move the cursor. */
+			ob_mv(r, from+1);
+			continue;
+		}
+		
+		if (CELL_AT(row[from]) != tc_at)
+			ob_at(CELL_AT(row[from]));
+		ob_wr(c, u8_enc(CELL_CH(row[from]), c));
+		
+		if (n >= REP_MIN && (tcap & TC_REP)) {
+			ob_wr(CSI, sizeof(CSI)-1);
+			ob_num(n-1);
+			ob_str(REP_CMD);
+		}
+		/* The wide character is drawn over the next cell too. */
+		else if (from+1 < scr_cols &&
+		    CELL_CH(row[from+1]) == WIDE_CONT)
+			n = 2;
+		else
+			n = 1;
+		memcpy(ol+from, row+from, n * sizeof(CELL));
+		from += n;
+		tc_x = from+1;
+	}
+	
+	tc_y = r;
+	/*
+	 * After the last column the terminal cursor stays in it
+	 * until the next character is printed, so we can't rely on
+	 * where it is.
+	 */
+	tc_x = from < scr_cols ? from+1 : 0;
+}
+
+/*
+ * Hash of `n' cells at `c'.
+ */
+unsigned long
+cells_hash(CELL* c, size_t n)
+{
+	unsigned long h;
+	
+	/* FNV-1a. */
+	for (h = 2166136261UL; n > 0; ++c, --n)
+		h = (h ^ *c) * 16777619UL;
+	return h;
+}
+
+/*
+ * Find out if rows [`top', `bot'] of the new screen are (mostly) the
+ * old ones scrolled.  The row hashes are expected to be in `scr_hnw'
+ * and `scr_hol'.
+ * --
+ * Only terminals that can set the scrolling region are scrolled.
+ * --
+ * Returns the number of rows the text has moved up by (or down by, if
+ * it is negative), or `0' if scrolling wouldn't save anything.
+ */
+int
+scr_scrl_find(US top, US bot)
+{
+	/* The best shift found so far and how many rows it saves. */
+	int best;
+	int best_gain;
+	int gain;
+	int k;
+	int n;
+	int r;
+	unsigned long* nw;
+	unsigned long* ol;
+	
+	if (!(tcap & TC_CSR))
+		return 0;
+	
+	nw = scr_hnw + top-1;
+	ol = scr_hol + top-1;
+	n = bot-top+1;
+	best = 0;
+	/* It must save at least one row more than it costs to scroll. */
+	best_gain = 1;
+	
+	for (k = 1-n; k < n; ++k) {
+		if (k == 0)
+			continue;
+		/*
+		 * Rows that will not need to be sent after scrolling,
+		 * minus rows that were fine, but will need to be sent.
+		 */
+		gain = 0;
+		for (r = 0; r < n; ++r) {
+			if (r+k < 0 || r+k >= n)
+				gain -= nw[r] == ol[r];
+			else if (nw[r] != ol[r])
+				gain += nw[r] == ol[r+k];
+			else
+				gain -= nw[r] != ol[r+k];
+		}
+		if (gain > best_gain) {
+			best = k;
+			best_gain = gain;
+		}
+	}
+	
+	return best;
+}
+
+/*
+ * Scroll rows [`top', `bot'] of the terminal by `k' rows up (or down,
+ * if `k' is negative), and do the same with the old screen, so it keeps
+ * what the terminal shows.
+ * --
+ * With the text rows being the scrolling region, it's done by deleting
+ * (or inserting) lines at `top'.  If the terminal can't do that, the
+ * region is narrowed down to `top' and scrolled.
+ */
+void
+scr_scrl(US top, US bot, int k)
+{
+	CELL* ol;
+	size_t n;
+	size_t i;
+	int j;
+	
+	/* The rows exposed by scrolling are filled with the current colors. */
+	if (tc_at != 0)
+		ob_at(0);
+	
+	if (bot == scr_rows-1 && (tcap & (k > 0 ? TC_DL : TC_IL))) {
+		ob_rgn(1, bot);
+		ob_mv(top, 1);
+		ob_wr(CSI, sizeof(CSI)-1);
+		ob_num(k > 0 ? k : -k);
+		ob_str(k > 0 ? DL_CMD : IL_CMD);
+		/* The cursor goes to the first column. */
+		tc_y = top;
+		tc_x = 1;
+	}
+	else if (tcap & (k > 0 ? TC_SU : TC_SD)) {
+		ob_rgn(top, bot);
+		ob_wr(CSI, sizeof(CSI)-1);
+		ob_num(k > 0 ? k : -k);
+		ob_str(k > 0 ? SCRL_UP_CMD : SCRL_DWN_CMD);
+	}
+	/* Scroll it line by line with index and reverse index. */
+	else {
+		ob_rgn(top, bot);
+		ob_mv(k > 0 ? bot : top, 1);
+		for (j = k > 0 ? k : -k; j > 0; --j)
+			ob_str(k > 0 ? IND_CMD : RI_CMD);
+		tc_y = k > 0 ? bot : top;
+		tc_x = 1;
+	}
+	
+	ol = scr_ol + (top-1) * scr_cols;
+	n = (size_t)(bot-top+1) * scr_cols;
+	if (k > 0) {
+		memmove(ol, ol + k*scr_cols, (n - k*scr_cols) * sizeof(CELL));
+		memmove(scr_hol + top-1, scr_hol + top-1 + k,
+		    (bot-top+1-k) * sizeof(unsigned long));
+		for (i = n - k*scr_cols; i < n; ++i)
+			ol[i] = BLANK;
+	}
+	else {
+		k = -k;
+		memmove(ol + k*scr_cols, ol, (n - k*scr_cols) * sizeof(CELL));
+		memmove(scr_hol + top-1 + k, scr_hol + top-1,
+		    (bot-top+1-k) * sizeof(unsigned long));
+		for (i = 0; i < (size_t)k*scr_cols; ++i)
+			ol[i] = BLANK;
+	}
+}
+
+/*
+ * Find out if the row `nw' of the new screen is the row `ol' of the old
+ * one with some characters inserted at (or deleted from) the column
+ * `first' they start to differ from.
+ * --
+ * Returns the number of characters inserted (or deleted, if it is
+ * negative), or `0' if it's not the case or it's not worth it.
+ */
+int
+scr_chsh_find(CELL* nw, CELL* ol, US first)
+{
+	int k;
+	US j;
+	/* Where the trailing blank cells of the old row start. */
+	US end;
+	
+	for (end = scr_cols; end > first && ol[end-1] == BLANK; --end)
+		;
+	/* If there's almost nothing to shift, just print it anew. */
+	if (end - first < CHSH_MAX)
+		return 0;
+	/* Wide characters could be split by shifting. */
+	for (j = first; j < scr_cols; ++j) {
+		if (CELL_CH(nw[j]) == WIDE_CONT || CELL_CH(ol[j]) == WIDE_CONT)
+			return 0;
+	}
+	
+	for (k = 1; k <= CHSH_MAX; ++k) {
+		if (tcap & TC_ICH) {
+			for (j = first+k; j < scr_cols && nw[j] == ol[j-k]; ++j)
+				;
+			if (j == scr_cols)
+				return k;
+		}
+		if (tcap & TC_DCH) {
+			for (j = first; j+k < scr_cols && nw[j] == ol[j+k]; ++j)
+				;
+			if (j+k == scr_cols)
+				return -k;
+		}
+	}
+	
+	return 0;
+}
+
+/*
+ * Insert `k' characters at the column `first' of the row `r' of the
+ * terminal (or delete them, if `k' is negative), and do the same with
+ * the old screen.
+ */
+void
+scr_chsh(US r, US first, int k)
+{
+	CELL* ol;
+	US j;
+	
+	ol = scr_ol + (r-1) * scr_cols;
+	if (tc_at != 0)
+		ob_at(0);
+	ob_mv(r, first+1);
+	ob_wr(CSI, sizeof(CSI)-1);
+	ob_num(k > 0 ? k : -k);
+	ob_str(k > 0 ? ICH_CMD : DCH_CMD);
+	
+	if (k > 0) {
+		memmove(ol+first+k, ol+first,
+		    (scr_cols-first-k) * sizeof(CELL));
+		for (j = first; j < first+k; ++j)
+			ol[j] = BLANK;
+	}
+	else {
+		k = -k;
+		memmove(ol+first, ol+first+k,
+		    (scr_cols-first-k) * sizeof(CELL));
+		for (j = scr_cols-k; j < scr_cols; ++j)
+			ol[j] = BLANK;
+	}
+}
+
+/*
+ * Update the terminal screen: send it the cells of the new screen that
+ * differ from the old one, and put the cursor where the virtual one is.
+ * The old screen becomes the same as the new one.
+ * --
+ * If the text has been scrolled, the terminal is asked to scroll it
+ * first, so only the rows that scrolling exposes are to be sent.  The
+ * same is done with characters inserted to or deleted from a row.
+ * --
+ * If the terminal hasn't taken the previous frame yet, nothing is
+ * done: the frames drawn meanwhile are never sent, and the one that
+ * is drawn by the time the terminal is ready is sent instead.
+ */
+void
+scr_flush()
+{
+	CELL* nw;
+	CELL* ol;
+	US r;
+	/* The first and the last cells that changed in the row. */
+	US first;
+	US last;
+	/* Where the trailing blank cells of the row start. */
+	US end;
+	/* By how many rows the text has been scrolled. */
+	int k;
+	
+	if (scr_nw == NULL || !ob_flush())
+		return;
+	
+	if (scr_clr) {
+		ob_at(0);
+		ob_rgn(0, 0);
+		ob_str(ERS_ALL_CMD);
+		tc_y = tc_x = 0;
+		scr_clr = 0;
+	}
+	
+	/*
+	 * The rows above the ``CMD'' line are the ones that scroll.  The
+	 * rows above the first changed one stay in place.
+	 */
+	if (scr_rows > 2) {
+		for (r = 0; r < scr_rows-1; ++r) {
+			scr_hnw[r] = cells_hash(scr_nw + r*scr_cols, scr_cols);
+			scr_hol[r] = cells_hash(scr_ol + r*scr_cols, scr_cols);
+		}
+		for (r = 1; r < scr_rows-1 && scr_hnw[r-1] == scr_hol[r-1]; ++r)
+			;
+		if ((k = scr_scrl_find(r, scr_rows-1)) != 0)
+			scr_scrl(r, scr_rows-1, k);
+	}
+	
+	for (r = 1; r <= scr_rows; ++r) {
+		nw = scr_nw + (r-1) * scr_cols;
+		ol = scr_ol + (r-1) * scr_cols;
+		if (memcmp(nw, ol, scr_cols * sizeof(CELL)) == 0)
+			continue;
+		
+		for (first = 0; nw[first] == ol[first]; ++first)
+			;
+		if ((k = scr_chsh_find(nw, ol, first)) != 0) {
+			scr_chsh(r, first, k);
+			if (memcmp(nw, ol, scr_cols * sizeof(CELL)) == 0)
+				continue;
+			for (first = 0; nw[first] == ol[first]; ++first)
+				;
+		}
+		/* A wide character is sent as a whole. */
+		if (first > 0 && CELL_CH(nw[first]) == WIDE_CONT)
+			first--;
+		for (last = scr_cols-1; nw[last] == ol[last]; --last)
+			;
+		for (end = scr_cols; end > first && nw[end-1] == BLANK; --end)
+			;
+		
+		/*
+		 * If the row ends with blanks which weren't there, it's
+		 * cheaper to erase the rest of the row than to print them.
+		 */
+		if (end <= last) {
+			if (first < end)
+				scr_put(r, first, end);
+			ob_mv(r, end+1);
+			if (tc_at != 0)
+				ob_at(0);
+			ob_str(ERS_LINE_FWD_CMD);
+		}
+		else
+			scr_put(r, first, last+1);
+		
+		memcpy(ol, nw, scr_cols * sizeof(CELL));
+	}
+	
+	ob_mv(scr_y0 + vc_y, scr_x0 + CLAMP_MAX(vc_x, scr_w));
+	
+	ob_flush();
+}
+
+/*
+ * Is there user input that can be read without waiting.
+ */
+char
+in_pend()
+{
+	struct pollfd pfd;
+	
+	if (in_l != 0 || mc_n != 0 || mc_ta_l != 0)
+		return 1;
+	pfd.fd = STDIN_FILENO;
+	pfd.events = POLLIN;
+	return poll(&pfd, 1, 0) == 1;
+}
+
+/*
+ * Add the descriptor `fd' to what the main loop waits for: `fn' is
+ * called with it once it's ready for reading, and it's up to `fn' to
+ * read it (see `ev_drain').
+ */
+void
+ev_add(int fd, void (*fn)(int))
+{
+	if (evs_l == EV_MAX)
+		errx(1, "Too many event sources");
+	evs[evs_l].fd = fd;
+	evs[evs_l].fn = fn;
+	evs_l++;
+}
+
+/*
+ * Read everything there's in the (non-blocking) descriptor `fd'.
+ * The events themselves don't matter, just that there were some.
+ */
+void
+ev_drain(int fd)
+{
+	/* Big enough for signalfd(2) as well. */
+	char b[512];
+	
+	while (read(fd, b, sizeof(b)) > 0)
+		;
+}
+
+/*
+ * Run the work that other threads have handed to the main one.
+ */
+void
+ev_run_jobs(int fd)
+{
+	struct ev_job* jobs;
+	size_t l;
+	size_t i;
+	
+	ev_drain(fd);
+	pthread_mutex_lock(&ev_mtx);
+	jobs = ev_jobs;
+	l = ev_jobs_l;
+	ev_jobs = NULL;
+	ev_jobs_l = 0;
+	ev_jobs_sz = 0;
+	pthread_mutex_unlock(&ev_mtx);
+	
+	for (i = 0; i < l; ++i)
+		jobs[i].fn(jobs[i].arg);
+	free(jobs);
+}
+
+/*
+ * Have `fn' called with `arg' by the main thread, between the keys.
+ * It may be called from any thread: this is how a worker delivers its
+ * results without touching what the main thread works with.
+ */
+void
+ev_post(void (*fn)(void*), void* arg)
+{
+	uint64_t one;
+	
+	pthread_mutex_lock(&ev_mtx);
+	if (ev_jobs_l == ev_jobs_sz) {
+		ev_jobs_sz = ev_jobs_sz == 0 ? 8 : 2 * ev_jobs_sz;
+		ev_jobs = srealloc(ev_jobs, ev_jobs_sz * sizeof(struct ev_job));
+	}
+	ev_jobs[ev_jobs_l].fn = fn;
+	ev_jobs[ev_jobs_l].arg = arg;
+	ev_jobs_l++;
+	pthread_mutex_unlock(&ev_mtx);
+	
+	/* An eventfd(2) wants 8 bytes, a pipe takes whatever it's given. */
+	one = 1;
+	if (write(ev_wk_wr, &one, sizeof(one)) == -1 && errno != EAGAIN)
+		warn("Can not wake the main thread up");
+}
+
+/*
+ * Set up the wakeups of the main loop by the other threads (see
+ * `ev_post').
+ */
+void
+ev_init()
+{
+#ifdef HAVE_EVFD
+	if ((ev_wk_rd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+		err(1, "Can not create an eventfd");
+	ev_wk_wr = ev_wk_rd;
+#else
+	int pp[2];
+	
+	if (pipe(pp) == -1)
+		err(1, "Can not create a pipe");
+	fcntl(pp[0], F_SETFL, O_NONBLOCK);
+	fcntl(pp[1], F_SETFL, O_NONBLOCK);
+	ev_wk_rd = pp[0];
+	ev_wk_wr = pp[1];
+#endif
+	ev_add(ev_wk_rd, ev_run_jobs);
+}
+
+/*
+ * Create a timer of the main loop: `fn' is called with it once it
+ * expires (see `tm_set').  Return its descriptor, or `-1' if there
+ * are no timers on this system.
+ */
+int
+tm_new(void (*fn)(int))
+{
+#ifdef HAVE_EVFD
+	int fd;
+	
+	if ((fd = timerfd_create(CLOCK_MONOTONIC,
+	    TFD_NONBLOCK | TFD_CLOEXEC)) != -1)
+		ev_add(fd, fn);
+	return fd;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Make the timer `fd' expire once in `ms' ms; `0' stops it.
+ */
+void
+tm_set(int fd, long ms)
+{
+#ifdef HAVE_EVFD
+	struct itimerspec its;
+	
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = ms % 1000 * 1000000;
+	timerfd_settime(fd, 0, &its, NULL);
+#endif
+}
+
+/*
+ * Wait until there's user input to read.  Meanwhile the terminal is
+ * fed with the frame (and the newest one after it) while it's taking
+ * it, and the other events (`evs') are handled as they come; what
+ * their handlers draw is shown at once, unless the user is typing.
+ */
+void
+ev_wait()
+{
+	struct pollfd pfd[2 + EV_MAX];
+	size_t i;
+	size_t j;
+	size_t n;
+	
+	for (;;) {
+		pfd[0].fd = STDIN_FILENO;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = obuf_l != 0 ? out_fd : -1;
+		pfd[1].events = POLLOUT;
+		for (n = 0; n < evs_l; ++n) {
+			pfd[2+n].fd = evs[n].fd;
+			pfd[2+n].events = POLLIN;
+		}
+		if (poll(pfd, 2+n, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		
+		if (pfd[1].revents != 0 && ob_flush())
+			scr_flush();
+		/* A handler may add sources. */
+		for (i = 0; i < n; ++i) {
+			if (pfd[2+i].revents == 0)
+				continue;
+			for (j = 0; j < evs_l && evs[j].fd != pfd[2+i].fd; ++j)
+				;
+			if (j < evs_l)
+				evs[j].fn(evs[j].fd);
+			if (!in_pend())
+				scr_flush();
+		}
+		if (pfd[0].revents != 0)
+			return;
+	}
+}
+
+/*
+ * Add `l' bytes of user input at `s' to the macro being recorded.
+ */
+void
+mc_add(char* s, size_t l)
+{
+	struct mc* mc;
+	
+	mc = &mcs[mc_rec - 'a'];
+	if (mc->l + l > mc->sz) {
+		mc->sz = 2 * (mc->l + l);
+		mc->s = srealloc(mc->s, mc->sz);
+	}
+	memcpy(mc->s + mc->l, s, l);
+	mc->l += l;
+}
+
+/*
+ * Put as much of the macro being played into `in_buf' as there's room
+ * for, over and over again as many times as it's played.  Once it's all
+ * been handled, the input put aside (`mc_ta') takes its place.
+ * --
+ * The keys are taken by the handlers as if they were typed, and as far
+ * as more of them are pending, the screen is not updated until they
+ * all are handled.
+ */
+void
+mc_fill()
+{
+	size_t l;
+	
+	memmove(in_buf, in_buf+in_x, in_l);
+	in_x = 0;
+	if (in_l == 0 && mc_n == 0) {
+		mc_on = 0;
+		memcpy(in_buf, mc_ta, mc_ta_l);
+		in_l = mc_ta_l;
+		mc_ta_l = 0;
+		return;
+	}
+	while (mc_n != 0 && in_l < IOBUF) {
+		l = CLAMP_MAX(mc_pl->l - mc_x, IOBUF - in_l);
+		memcpy(in_buf+in_l, mc_pl->s + mc_x, l);
+		in_l += l;
+		mc_x += l;
+		if (mc_x == mc_pl->l) {
+			mc_x = 0;
+			mc_n--;
+		}
+	}
+}
+
+/*
+ * Stop playing the macro: the rest of its keys are thrown away.
+ */
+void
+mc_stop()
+{
+	mc_n = 0;
+	in_l = 0;
+	mc_fill();
+}
+
+/*
+ * Wait for the filter being looked for in the background, and set it
+ * (see `fl_done').  The keys do it before they are handled, so that
+ * the text doesn't change under the threads looking at it.
+ */
+void
+fl_wait()
+{
+	struct pollfd pfd;
+	
+	pfd.fd = ev_wk_rd;
+	pfd.events = POLLIN;
+	while (fl_busy) {
+		poll(&pfd, 1, -1);
+		ev_run_jobs(ev_wk_rd);
+	}
+}
+
+/*
+ * Read one byte of user input into `c'.  As far as we are going to
+ * wait for the user, it's time to show what we've drawn so far.
+ * --
+ * If more input is already there (a paste, key repeat), it is not
+ * shown yet: the screen is updated once that input is handled, so
+ * a whole burst of keys costs one frame.  The burst is read all at
+ * once into `in_buf' as well, and handed out from there byte by byte.
+ * --
+ * Return format is the same as for read(2).
+ */
+ssize_t
+rd_in(char* c)
+{
+	ssize_t n;
+	
+	if (in_l == 0 && mc_on)
+		mc_fill();
+	if (in_l != 0) {
+		fl_wait();
+		*c = in_buf[in_x++];
+		in_l--;
+		return 1;
+	}
+	
+	if (!in_pend())
+		scr_flush();
+	
+	/*
+	 * While the terminal is taking the frame and the other events
+	 * are handled, the user doesn't wait for that.
+	 */
+	ev_wait();
+	
+	n = read(STDIN_FILENO, in_buf, IOBUF);
+	if (n <= 0)
+		return n;
+	fl_wait();
+	if (mc_rec != 0)
+		mc_add(in_buf, n);
+	*c = in_buf[0];
+	in_x = 1;
+	in_l = n-1;
+	return 1;
+}
+
+/*
+ * Wait up to `ms' ms for more user input and add it to `in_buf'.
+ * Return whether some has come.
+ */
+char
+in_more(int ms)
+{
+	struct pollfd pfd;
+	ssize_t n;
+	size_t l;
+	
+	if (in_l == IOBUF)
+		return 0;
+	/* The macro being played goes on without waiting. */
+	if (mc_on) {
+		l = in_l;
+		if (mc_n != 0)
+			mc_fill();
+		return in_l != l;
+	}
+	memmove(in_buf, in_buf+in_x, in_l);
+	in_x = 0;
+	
+	pfd.fd = STDIN_FILENO;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, ms) != 1 ||
+	    (n = read(STDIN_FILENO, in_buf+in_l, IOBUF-in_l)) <= 0)
+		return 0;
+	if (mc_rec != 0)
+		mc_add(in_buf+in_l, n);
+	in_l += n;
+	return 1;
+}
+
+/*
+ * Decode the escape sequence that follows the `ESC' just read and
+ * return the key (`KEY_*') it stands for.  The sequences from the
+ * terminfo(5) entry are tried first, then the usual `CSI' and `SS3'
+ * ones: these are told by their final character and, for `~', by
+ * their first number (see `csi_keys').
+ * --
+ * If nothing follows within `esc_delay' ms (or the sequence doesn't
+ * end within it), it's the `ESC' key itself, and so it is if it's
+ * followed by something that is not a sequence.  In both cases what
+ * follows is left to be handled as usual.
+ */
+int
+in_key()
+{
+	/* Final character, first number (`-1' for any) and the key. */
+	static const int csi_keys[][3] = {
+		{ 'A', -1, KEY_UP }, { 'B', -1, KEY_DOWN },
+		{ 'C', -1, KEY_RIGHT }, { 'D', -1, KEY_LEFT },
+		{ 'H', -1, KEY_HOME }, { 'F', -1, KEY_END },
+		{ '~', 1, KEY_HOME }, { '~', 7, KEY_HOME },
+		{ '~', 4, KEY_END }, { '~', 8, KEY_END },
+		{ '~', 5, KEY_PGUP }, { '~', 6, KEY_PGDN },
+		{ '~', 200, KEY_PST }
+	};
+	size_t i;
+	size_t l;
+	int num;
+	char fin;
+	
+	if (in_l == 0 && !in_more(esc_delay))
+		return KEY_ESC;
+	
+	for (i = 0; i < KEY_N; ++i) {
+		l = strlen(tkey[i]);
+		if (l != 0 && l <= in_l &&
+		    memcmp(in_buf+in_x, tkey[i], l) == 0) {
+			in_x += l;
+			in_l -= l;
+			return i;
+		}
+	}
+	
+	if (in_buf[in_x] != '[' && in_buf[in_x] != 'O')
+		return KEY_ESC;
+	/*
+	 * `SS3' is followed by the final character at once, `CSI' by
+	 * the numbers and the intermediate characters before it.
+	 */
+	for (i = 1; ; ++i) {
+		if (i == in_l && !in_more(esc_delay))
+			return KEY_ESC;
+		if (in_buf[in_x] == 'O' || in_buf[in_x+i] < 0x20 ||
+		    in_buf[in_x+i] >= 0x40)
+			break;
+	}
+	fin = in_buf[in_x+i];
+	num = strtol(in_buf+in_x+1, NULL, 10);
+	/* A broken sequence is dropped up to the odd character. */
+	if (fin < 0x40 || fin == 0x7f) {
+		in_x += i;
+		in_l -= i;
+		return KEY_NONE;
+	}
+	in_x += i+1;
+	in_l -= i+1;
+	
+	for (i = 0; i < sizeof(csi_keys)/sizeof(*csi_keys); ++i) {
+		if (csi_keys[i][0] == fin &&
+		    (csi_keys[i][1] == -1 || csi_keys[i][1] == num))
+			return csi_keys[i][2];
+	}
+	return KEY_NONE;
+}
+
+/*
+ * Read what is being pasted, up to `PST_END' (`KEY_PST' has been read
+ * already), into a buffer allocated for it.  It's `n' bytes long.
+ */
+char*
+rd_pst(size_t* n)
+{
+	char* s;
+	size_t sz;
+	/* How much of `PST_END' has been read. */
+	size_t m;
+	char c;
+	
+	sz = IOBUF;
+	s = smalloc(sz);
+	*n = 0;
+	for (m = 0; m < sizeof(PST_END)-1 && rd_in(&c) == 1; ) {
+		if (*n == sz)
+			s = srealloc(s, sz *= 2);
+		s[(*n)++] = c;
+		m = c == PST_END[m] ? m+1 : c == PST_END[0];
+	}
+	*n -= m;
+	return s;
+}
+
+/*
+ * Free `lns', every `ln' and `ln->str' within it.
+ */
+void
+free_lns()
+{
+	size_t i;
+	
+	for (i = 0; i < lns_l; ++i)
+		FREE_LN(i);
+	
+	free(lns);
+	lns = NULL;
+	lns_l = 0;
+}
+
+/*
+ * Free all global pointers.
+ */
+void
+free_all()
+{
+	free_lns();
+	free(filepath);
+	free(cmd_txt);
+	free(obuf);
+	free(scr_nw);
+	free(scr_ol);
+	free(scr_hnw);
+	free(scr_hol);
+	filepath = NULL;
+	cmd_txt = NULL;
+	obuf = NULL;
+	obuf_l = obuf_sz = 0;
+	scr_nw = scr_ol = NULL;
+	scr_hnw = scr_hol = NULL;
+}
+
+/*
+ * Terminate the program: show the last frame, free all the data,
+ * return to the canonical terminal mode and exit.
+ * --
+ * It is also called at exit(3), so it must be fine to call it twice.
+ */
+void
+terminate()
+{
+	/* What's left of the screen is to be written out for sure. */
+	if (out_fd != STDOUT_FILENO)
+		fcntl(out_fd, F_SETFL, fcntl(out_fd, F_GETFL) & ~O_NONBLOCK);
+	scr_flush();
+	/* Give the whole screen back to the shell. */
+	ob_rgn(0, 0);
+	ob_str(PST_OFF_CMD);
+	ob_flush();
+	free_all();
+	/*
+	 * Restore original terminal settings.
+	 * --
+	 * `TCSANOW' flag is for changes to be applied immediately.
+	 */
+	if (tcsetattr(STDOUT_FILENO, TCSANOW, &orig_tos) == -1)
+		err(1, "Can not restore original terminal attributes");
+	exit(0);
+}
+
+/*
+ * Set raw (non-canonical) terminal mode.
+ * See termios(4).
+ * --
+ * It is important to save the terminal's current settings into memory
+ * _before_ we alter them, to restore them after editor's closed.
+ */
+void
+set_raw()
+{
+	/* Save current settings in `tos'. */
+	if (tcgetattr(STDOUT_FILENO, &tos) == -1)
+		err(1, "Can not get terminal attributes");
+	
+	/* Save (copy) current settings to be able to restore them later. */
+	orig_tos = tos;
+	
+	/* Schedule restoring terminal settings at program's exit. */
+	if (atexit(&terminate) == -1)
+		err(1, "Can not register the exit-function");
+	
+	/*
+	 * The following flags are set to enter non-canonical mode.
+	 * More detailed meanings of these are in termios(4).
+	 */
+	
+	/*
+	 * Disable:
+	 *     `ECHO' and `ECHONL' - to not to echo things back.
+	 *     `ICANON' - read byte-by-byte instead of default line-by-line.
+	 *     `ISIG' - to turn off default keybinding for signals.
+	 *              I.e. `CTRL+C' for `SIGINT'.
+	 */
+	tos.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG);
+	
+	/*
+	 * Disable:
+	 *     `IXON' - prevent software flow control.  These are the things
+	 *              like `CTRL+S' (freeze) and `CTRL+Q' (unfreeze).
+	 *     `ICRNL' - to not to map `CR' (`\r') to `NL' (`\n').
+	 */
+	tos.c_iflag &= ~(IXON | ICRNL);
+	
+	/*
+	 * Disable:
+	 *     `OPOST' - to turn off output processing, so we need to manually
+	 *               send `\r\n' instead of just `\n' every time we want
+	 *               to print a new line.
+	 */
+	tos.c_oflag &= ~OPOST;
+	
+	/*
+	 * read(2) satisfies as soon as 1 byte has been read.  The
+	 * short wait for the rest of an escape sequence is done by
+	 * `in_key' itself.
+	 */
+	tos.c_cc[VMIN] = 1;
+	tos.c_cc[VTIME] = 0;
+	
+	/* Apply all changes we have just done. */
+	if (tcsetattr(STDOUT_FILENO, TCSANOW, &tos) == -1)
+		err(1, "Can not set terminal attributes");
+}
+
+/*
+ * Expand `lns' at the end, so that there's room for `n' more lines.
+ * Allocate space for:
+ *     - `ln' pointer.
+ *     - `ln' struct.
+ *     - `ln->str' string.
+ * 
+ */
+void
+expand_lns(size_t n)
+{
+	size_t i;
+	size_t old;
+	
+	old = lns_sz;
+	lns_sz = lns_l + (n > LNS_EXPAND ? n : LNS_EXPAND);
+	lns = srealloc(lns, lns_sz * sizeof(struct ln*));
+	
+	/*
+	 * Initialize objects for new lines.
+	 */
+	for (i = old; i < lns_sz; ++i)
+		INIT_LN(i);
+}
+
+/*
+ * Check if file at `path' does exist.
+ */
+char
+check_exists(char* path)
+{
+	struct stat st;
+		
+	return stat(path, &st) != -1;
+}
+
+#ifdef HAVE_URING
+/*
+ * Set up the io_uring(7) instance `ur' with `n' entries.  It is done
+ * with raw system calls, so we don't depend on liburing.
+ * --
+ * Returns `-1' if io_uring is not available (old kernel, or it is
+ * disabled), in which case the ordinary read(2)/write(2) are used.
+ */
+int
+ur_init(struct uring* ur, unsigned n)
+{
+	struct io_uring_params p;
+	char* sq;
+	char* cq;
+	
+	memset(&p, 0, sizeof(p));
+	if ((ur->fd = syscall(__NR_io_uring_setup, n, &p)) == -1)
+		return -1;
+	
+	ur->sq_map_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ur->cq_map_sz = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	/* Both rings may live in the one mapping. */
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ur->cq_map_sz > ur->sq_map_sz)
+			ur->sq_map_sz = ur->cq_map_sz;
+		ur->cq_map_sz = ur->sq_map_sz;
+	}
+	ur->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	
+	ur->sq_map = mmap(NULL, ur->sq_map_sz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+	if (ur->sq_map == MAP_FAILED)
+		goto fail_sq;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ur->cq_map = ur->sq_map;
+	else {
+		ur->cq_map = mmap(NULL, ur->cq_map_sz, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_CQ_RING);
+		if (ur->cq_map == MAP_FAILED)
+			goto fail_cq;
+	}
+	ur->sqes = mmap(NULL, ur->sqes_sz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+	if (ur->sqes == MAP_FAILED)
+		goto fail_sqes;
+	
+	sq = ur->sq_map;
+	cq = ur->cq_map;
+	ur->sq_head = (unsigned*)(sq + p.sq_off.head);
+	ur->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+	ur->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+	ur->sq_arr = (unsigned*)(sq + p.sq_off.array);
+	ur->cq_head = (unsigned*)(cq + p.cq_off.head);
+	ur->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+	ur->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+	ur->pend = 0;
+	
+	return 0;
+	
+fail_sqes:
+	if (ur->cq_map != ur->sq_map)
+		munmap(ur->cq_map, ur->cq_map_sz);
+fail_cq:
+	munmap(ur->sq_map, ur->sq_map_sz);
+fail_sq:
+	close(ur->fd);
+	return -1;
+}
+
+/*
+ * Tear down the io_uring(7) instance set up by `ur_init'.
+ */
+void
+ur_free(struct uring* ur)
+{
+	munmap(ur->sqes, ur->sqes_sz);
+	if (ur->cq_map != ur->sq_map)
+		munmap(ur->cq_map, ur->cq_map_sz);
+	munmap(ur->sq_map, ur->sq_map_sz);
+	close(ur->fd);
+}
+
+/*
+ * Queue a vectored read or write (`op') of `fd' at offset `off' with
+ * `n' vectors at `iov'.  The request will be identified by `data' on
+ * its completion.  The caller makes sure there is a free entry for it.
+ */
+void
+ur_put(struct uring* ur, int op, int fd, struct iovec* iov, unsigned n,
+    off_t off, unsigned data)
+{
+	struct io_uring_sqe* sqe;
+	unsigned tail;
+	unsigned i;
+	
+	tail = *ur->sq_tail;
+	i = tail & *ur->sq_mask;
+	sqe = &ur->sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)iov;
+	sqe->len = n;
+	sqe->off = off;
+	sqe->user_data = data;
+	ur->sq_arr[i] = i;
+	__atomic_store_n(ur->sq_tail, tail+1, __ATOMIC_RELEASE);
+	ur->pend++;
+}
+
+/*
+ * Submit the queued requests and get the result of the one that
+ * completes first: its identifier goes to `data', and the result
+ * (as read(2)/write(2) would return, but `-errno' on error) to `res'.
+ * --
+ * Returns `-1' if io_uring_enter(2) itself fails.
+ */
+int
+ur_get(struct uring* ur, unsigned* data, int* res)
+{
+	struct io_uring_cqe* cqe;
+	unsigned head;
+	
+	for (;;) {
+		head = *ur->cq_head;
+		if (head != __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &ur->cqes[head & *ur->cq_mask];
+			*data = cqe->user_data;
+			*res = cqe->res;
+			__atomic_store_n(ur->cq_head, head+1,
+			    __ATOMIC_RELEASE);
+			return 0;
+		}
+		if (syscall(__NR_io_uring_enter, ur->fd, ur->pend, 1,
+		    IORING_ENTER_GETEVENTS, NULL, 0) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		ur->pend = 0;
+	}
+}
+#endif
+
+/*
+ * Append `n' bytes at `p' to the lines read so far.
+ * Every newline in there starts a new line.
+ */
+void
+parse_in(char* p, size_t n)
+{
+	/* Pointer to the next newline. */
+	char* nl;
+	/* Length of the line segment before `nl'. */
+	size_t sl;
+	
+	while (n > 0) {
+		nl = memchr(p, '\n', n);
+		sl = nl == NULL ? n : (size_t)(nl-p);
+		
+		if (lns[lns_l]->l + sl > lns[lns_l]->sz)
+			EXPAND_LN(lns_l, lns[lns_l]->l + sl - lns[lns_l]->sz);
+		memcpy(lns[lns_l]->str+lns[lns_l]->l, p, sl);
+		TOUCH_LN(lns_l, lns[lns_l]->l);
+		lns[lns_l]->l += sl;
+		
+		if (nl == NULL)
+			break;
+		
+		lns_l++;
+		if (lns_l == lns_sz)
+			expand_lns(1);
+		p = nl+1;
+		n -= sl+1;
+	}
+}
+
+#ifdef HAVE_URING
+/*
+ * Read the file at `fd' of `sz' bytes with io_uring(7).
+ * --
+ * `IO_QD' chunks are kept in flight, and while the kernel is reading
+ * them, we parse the ones that have already arrived (in order of their
+ * offsets).  Every parsed chunk is requested again for the next part
+ * of the file.
+ * --
+ * Returns the number of bytes parsed, with the last one put in `last'.
+ * It is less than `sz' if the engine is not available or a read came
+ * short: the rest is then left to the ordinary read(2).
+ */
+off_t
+ur_read_fd(int fd, off_t sz, char* last)
+{
+	struct uring ur;
+	struct iovec iov[IO_QD];
+	/* Bytes requested and arrived for every slot (`-1' if in flight). */
+	size_t want[IO_QD];
+	ssize_t got[IO_QD];
+	char* rbuf;
+	/* Offsets of the next chunk to request and the next to parse. */
+	off_t nx;
+	off_t off;
+	int infl;
+	int slot;
+	unsigned data;
+	int res;
+	
+	if (ur_init(&ur, IO_QD) == -1)
+		return 0;
 	
-	/* Schedule restoring terminal settings at program's exit. */
-	if (atexit(&terminate) == -1)
-		err(1, "Can not register the exit-function");
+	rbuf = smalloc(IO_QD * IO_CHUNK);
+	nx = off = 0;
+	infl = 0;
+	
+	for (slot = 0; slot < IO_QD && nx < sz; ++slot) {
+		iov[slot].iov_base = rbuf + slot*IO_CHUNK;
+		iov[slot].iov_len = want[slot] = CLAMP_MAX(sz-nx, IO_CHUNK);
+		got[slot] = -1;
+		ur_put(&ur, IORING_OP_READV, fd, &iov[slot], 1, nx, slot);
+		nx += want[slot];
+		infl++;
+	}
+	
+	for (slot = 0; off < sz; slot = (slot+1) % IO_QD) {
+		while (got[slot] == -1) {
+			if (ur_get(&ur, &data, &res) == -1)
+				err(1, "Error during reading a file");
+			if (res < 0) {
+				errno = -res;
+				err(1, "Error during reading a file");
+			}
+			got[data] = res;
+			infl--;
+		}
+		
+		parse_in(rbuf + slot*IO_CHUNK, got[slot]);
+		off += got[slot];
+		if (got[slot] > 0)
+			*last = rbuf[slot*IO_CHUNK + got[slot]-1];
+		if ((size_t)got[slot] != want[slot])
+			break;
+		
+		if (nx < sz) {
+			iov[slot].iov_len = want[slot] =
+			    CLAMP_MAX(sz-nx, IO_CHUNK);
+			got[slot] = -1;
+			ur_put(&ur, IORING_OP_READV, fd, &iov[slot], 1, nx,
+			    slot);
+			nx += want[slot];
+			infl++;
+		}
+	}
+	
+	/* Let the reads we won't use finish before freeing their memory. */
+	while (infl-- > 0)
+		if (ur_get(&ur, &data, &res) == -1)
+			err(1, "Error during reading a file");
+	
+	free(rbuf);
+	ur_free(&ur);
+	return off;
+}
+#endif
+
+/*
+ * Read contents of a file at file descriptor `fd' into buffer.
+ * --
+ * The `fd' is _not_ closed in this function.
+ * --
+ * This function is ought to be called only when we're sure
+ * that `lns' has at least been initialized.
+ */
+void
+read_fd(int fd)
+{
+	/* Actually read bytes. */
+	ssize_t arb;
+	/* Total number of bytes read. */
+	off_t tot;
+	/* The last byte read. */
+	char last;
+	char* rbuf;
+#ifdef HAVE_URING
+	struct stat st;
 	
 	/*
-	 * The following flags are set to enter non-canonical mode.
-	 * More detailed meanings of these are in termios(4).
+	 * Big regular files are read by the io_uring engine.  If it
+	 * didn't make it to the end, continue in the ordinary way.
+	 */
+	tot = 0;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+	    st.st_size >= IO_CHUNK &&
+	    (tot = ur_read_fd(fd, st.st_size, &last)) > 0 &&
+	    lseek(fd, tot, SEEK_SET) == -1)
+		err(1, "Error during reading a file");
+#else
+	tot = 0;
+#endif
+	
+	rbuf = smalloc(IO_CHUNK);
+	while ((arb = read(fd, rbuf, IO_CHUNK)) > 0) {
+		parse_in(rbuf, arb);
+		last = rbuf[arb-1];
+		tot += arb;
+	}
+	free(rbuf);
+	
+	if (arb == -1)
+		err(1, "Error during reading a file");
+	
+	/*
+	 * In case the file is not terminated with a newline,
+	 * we 'insert' that newline, so that it would be written
+	 * back in the file.
+	 */
+	if (tot == 0 || last != '\n') {
+		lns_l++;
+		dirty = 1;
+	}
+	
+	if (tot == 0)
+		mod = MOD_EDT;
+}
+
+/*
+ * Is the byte `c' one of the characters of `set'.
+ */
+char
+hl_in(char c, const char* set)
+{
+	return c != '\0' && strchr(set, c) != NULL;
+}
+
+/*
+ * Get the end of the word that starts at `i' of `n' bytes `s'.  Words
+ * are made of letters, digits, underscores and of the bytes of `more'.
+ */
+size_t
+hl_word(const char* s, size_t n, size_t i, const char* more)
+{
+	while (i < n && (isalnum((unsigned char)s[i]) || s[i] == '_' ||
+	    hl_in(s[i], more)))
+		++i;
+	return i;
+}
+
+/*
+ * Find the closing quote `q' in `n' bytes `s' from `i' on.  If `esc'
+ * is set, a backslash escapes the character after it.
+ * --
+ * Returns the byte after the quote, or `0' if the text ends first.
+ */
+size_t
+hl_quo(const char* s, size_t n, size_t i, char q, char esc)
+{
+	for (; i < n; ++i) {
+		if (s[i] == q)
+			return i+1;
+		if (esc && s[i] == '\\')
+			++i;
+	}
+	return 0;
+}
+
+/*
+ * Is the word of `n' bytes `w' one of the `kws' (each of them is
+ * followed by a space).
+ */
+char
+hl_kw(const char* w, size_t n, const char* kws, char ign_case)
+{
+	const char* e;
+	
+	for (; (e = strchr(kws, ' ')) != NULL; kws = e+1) {
+		if ((size_t)(e-kws) == n && (ign_case ?
+		    strncasecmp(w, kws, n) : strncmp(w, kws, n)) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * The lexers of languages: each one takes the `n' bytes `s' of a line
+ * that starts in the state `st', puts the attribute for every byte of
+ * it in `at' (if it's not `NULL', and `at' is all zeros at first) and
+ * returns the state at its end.
+ */
+
+/*
+ * C and C++.  The only state is whether we're in a block comment.
+ */
+unsigned char
+hl_c(const char* s, size_t n, unsigned char st, unsigned char* at)
+{
+	size_t i;
+	size_t j;
+	
+	for (i = 0; i < n && (s[i] == ' ' || s[i] == '\t'); ++i)
+		;
+	/* A preprocessor directive and its header name. */
+	if (st == HL_ST_NONE && i < n && s[i] == '#') {
+		j = hl_word(s, n, i+1, "");
+		HL_PUT(at, i, j, HL_PP);
+		for (i = j; i < n && s[i] == ' '; ++i)
+			;
+		if (i < n && s[i] == '<') {
+			j = hl_quo(s, n, i+1, '>', 0);
+			j = j == 0 ? n : j;
+			HL_PUT(at, i, j, HL_STR);
+			i = j;
+		}
+	}
+	else
+		i = 0;
+	
+	while (i < n) {
+		if (st == HL_C_CMT) {
+			for (j = i; j+1 < n && (s[j] != '*' || s[j+1] != '/');
+			    ++j)
+				;
+			if (j+1 < n) {
+				j += 2;
+				st = HL_ST_NONE;
+			}
+			else
+				j = n;
+			HL_PUT(at, i, j, HL_CMT);
+			i = j;
+			continue;
+		}
+		
+		if (s[i] == '/' && i+1 < n && s[i+1] == '*') {
+			HL_PUT(at, i, i+2, HL_CMT);
+			i += 2;
+			st = HL_C_CMT;
+		}
+		else if (s[i] == '/' && i+1 < n && s[i+1] == '/') {
+			HL_PUT(at, i, n, HL_CMT);
+			break;
+		}
+		else if (s[i] == '"' || s[i] == '\'') {
+			j = hl_quo(s, n, i+1, s[i], 1);
+			j = j == 0 ? n : j;
+			HL_PUT(at, i, j, HL_STR);
+			i = j;
+		}
+		else if (isdigit((unsigned char)s[i])) {
+			j = hl_word(s, n, i, ".");
+			HL_PUT(at, i, j, HL_NUM);
+			i = j;
+		}
+		else if (isalpha((unsigned char)s[i]) || s[i] == '_') {
+			j = hl_word(s, n, i, "");
+			if (hl_kw(s+i, j-i, HL_C_KW, 0))
+				HL_PUT(at, i, j, HL_KW);
+			i = j;
+		}
+		else
+			++i;
+	}
+	
+	return st;
+}
+
+/*
+ * Shell.  Quoted strings may go on for many lines.
+ */
+unsigned char
+hl_sh(const char* s, size_t n, unsigned char st, unsigned char* at)
+{
+	size_t i;
+	size_t j;
+	char q;
+	
+	i = 0;
+	if (st != HL_ST_NONE) {
+		q = st == HL_SH_SQ ? '\'' : '"';
+		if ((i = hl_quo(s, n, 0, q, q == '"')) == 0) {
+			HL_PUT(at, 0, n, HL_STR);
+			return st;
+		}
+		HL_PUT(at, 0, i, HL_STR);
+	}
+	
+	while (i < n) {
+		if (s[i] == '\\')
+			i += 2;
+		else if (s[i] == '#' && (i == 0 || hl_in(s[i-1], " \t;|&("))) {
+			HL_PUT(at, i, n, HL_CMT);
+			break;
+		}
+		else if (s[i] == '\'' || s[i] == '"') {
+			q = s[i];
+			if ((j = hl_quo(s, n, i+1, q, q == '"')) == 0) {
+				HL_PUT(at, i, n, HL_STR);
+				return q == '\'' ? HL_SH_SQ : HL_SH_DQ;
+			}
+			HL_PUT(at, i, j, HL_STR);
+			i = j;
+		}
+		else if (s[i] == '$') {
+			j = i+1;
+			if (j < n && s[j] == '{') {
+				j = hl_quo(s, n, j, '}', 0);
+				j = j == 0 ? n : j;
+			}
+			else if (j < n && hl_in(s[j], "?!$#@*-"))
+				j++;
+			else
+				j = hl_word(s, n, j, "");
+			HL_PUT(at, i, j, HL_VAR);
+			i = j;
+		}
+		else if (isalpha((unsigned char)s[i]) || s[i] == '_') {
+			j = hl_word(s, n, i, "");
+			if ((j == n || !hl_in(s[j], "=/.")) &&
+			    (i == 0 || !hl_in(s[i-1], "-/.")) &&
+			    hl_kw(s+i, j-i, HL_SH_KW, 0))
+				HL_PUT(at, i, j, HL_KW);
+			i = j;
+		}
+		else
+			++i;
+	}
+	
+	return HL_ST_NONE;
+}
+
+/*
+ * YAML.  The state tells whether we're in a block scalar (`|' or `>'),
+ * and what is the indentation of the line it has started at.  The
+ * scalar goes on while the lines are indented more than that.
+ */
+unsigned char
+hl_yaml(const char* s, size_t n, unsigned char st, unsigned char* at)
+{
+	/* Indentation of the line. */
+	size_t ind;
+	size_t i;
+	size_t j;
+	/* Tokens of the value so far, and is there a space before this one. */
+	size_t tok;
+	char sp;
+	
+	for (ind = 0; ind < n && s[ind] == ' '; ++ind)
+		;
+	if (st & HL_YAML_BLK) {
+		if (ind == n || ind > (size_t)(st & ~HL_YAML_BLK)) {
+			HL_PUT(at, 0, n, HL_STR);
+			return st;
+		}
+		st = HL_ST_NONE;
+	}
+	
+	i = ind;
+	if (i == 0 && n >= 3 && (strncmp(s, "---", 3) == 0 ||
+	    strncmp(s, "...", 3) == 0)) {
+		HL_PUT(at, 0, 3, HL_PP);
+		i = 3;
+	}
+	/* Markers of sequence entries. */
+	while (i < n && s[i] == '-' && (i+1 == n || s[i+1] == ' ')) {
+		HL_PUT(at, i, i+1, HL_PP);
+		for (++i; i < n && s[i] == ' '; ++i)
+			;
+	}
+	/* A key: everything up to a colon followed by a space. */
+	for (j = i; j < n && s[j] != '#' && s[j] != '"' && s[j] != '\''; ++j) {
+		if (s[j] == ':' && (j+1 == n || s[j+1] == ' '))
+			break;
+	}
+	if (j < n && s[j] == ':' && j != i) {
+		HL_PUT(at, i, j, HL_VAR);
+		i = j+1;
+	}
+	
+	for (tok = 0, sp = 1; i < n; ++tok, sp = 0) {
+		if (s[i] == ' ' || s[i] == '\t') {
+			for (; i < n && (s[i] == ' ' || s[i] == '\t'); ++i)
+				;
+			sp = 1;
+			if (i == n)
+				break;
+		}
+		if (s[i] == '#' && sp) {
+			HL_PUT(at, i, n, HL_CMT);
+			break;
+		}
+		if (tok == 0 && (s[i] == '|' || s[i] == '>')) {
+			j = hl_word(s, n, i+1, "+-");
+			HL_PUT(at, i, j, HL_PP);
+			st = HL_YAML_BLK | CLAMP_MAX(ind, HL_YAML_IND_MAX);
+			i = j;
+		}
+		else if (s[i] == '"' || s[i] == '\'') {
+			j = hl_quo(s, n, i+1, s[i], s[i] == '"');
+			j = j == 0 ? n : j;
+			HL_PUT(at, i, j, HL_STR);
+			i = j;
+		}
+		else if (sp && hl_in(s[i], "&*!")) {
+			for (j = i+1; j < n && !hl_in(s[j], " \t,]}"); ++j)
+				;
+			HL_PUT(at, i, j, HL_PP);
+			i = j;
+		}
+		else if (isalnum((unsigned char)s[i]) || hl_in(s[i], "-+.~")) {
+			j = hl_word(s, n, i, "-+.~");
+			if (isdigit((unsigned char)s[i]) ||
+			    (j-i > 1 && hl_in(s[i], "-+.") &&
+			    isdigit((unsigned char)s[i+1])))
+				HL_PUT(at, i, j, HL_NUM);
+			else if (hl_kw(s+i, j-i, HL_YAML_KW, 1))
+				HL_PUT(at, i, j, HL_KW);
+			i = j;
+		}
+		else
+			++i;
+	}
+	
+	return st;
+}
+
+/*
+ * Logs.  The timestamp a line starts with, the severity levels and
+ * the quoted strings are highlighted.  There's no state.
+ */
+unsigned char
+hl_log(const char* s, size_t n, unsigned char st, unsigned char* at)
+{
+	size_t i;
+	size_t j;
+	
+	(void)st;
+	
+	i = n > 0 && s[0] == '[';
+	if (i < n && isdigit((unsigned char)s[i])) {
+		for (; i < n; ++i) {
+			if (isdigit((unsigned char)s[i]) ||
+			    hl_in(s[i], "-:./T,Z+"))
+				continue;
+			/* A space between the date and the time. */
+			if (s[i] == ' ' && i+1 < n &&
+			    isdigit((unsigned char)s[i-1]) &&
+			    isdigit((unsigned char)s[i+1]))
+				continue;
+			break;
+		}
+		if (s[0] == '[' && i < n && s[i] == ']')
+			++i;
+		HL_PUT(at, 0, i, HL_NUM);
+	}
+	else
+		i = 0;
+	
+	while (i < n) {
+		if (s[i] == '"') {
+			j = hl_quo(s, n, i+1, '"', 1);
+			j = j == 0 ? n : j;
+			HL_PUT(at, i, j, HL_STR);
+			i = j;
+		}
+		else if (isalpha((unsigned char)s[i])) {
+			j = hl_word(s, n, i, "");
+			if (hl_kw(s+i, j-i, HL_LOG_ERR, 1))
+				HL_PUT(at, i, j, HL_ERR);
+			else if (hl_kw(s+i, j-i, HL_LOG_WARN, 1))
+				HL_PUT(at, i, j, HL_WARN);
+			else if (hl_kw(s+i, j-i, HL_LOG_INFO, 1))
+				HL_PUT(at, i, j, HL_INFO);
+			i = j;
+		}
+		else
+			++i;
+	}
+	
+	return HL_ST_NONE;
+}
+
+/*
+ * The languages we know, they are found by filename suffixes (see
+ * `hl_detect').
+ */
+const struct hl_lang hl_langs[] = {
+	{ ".c .h .cc .cpp .cxx .hh .hpp .hxx ", hl_c },
+	{ ".sh .bash .ksh .zsh .profile .bashrc .kshrc .zshrc ", hl_sh },
+	{ ".yml .yaml ", hl_yaml },
+	{ ".log ", hl_log }
+};
+
+/*
+ * Find out the language of the buffer by its `filepath' (and by the
+ * ``#!'' line for shell scripts without a suffix).  Nothing has been
+ * lexed in it yet.
+ */
+void
+hl_detect()
+{
+	const char* sfx;
+	const char* base;
+	size_t base_l;
+	size_t l;
+	size_t i;
+	
+	hl_lang = NULL;
+	hl_l = 0;
+	if (filepath == NULL)
+		return;
+	
+	base = strrchr(filepath, '/');
+	base = base == NULL ? filepath : base+1;
+	base_l = strlen(base);
+	for (i = 0; i < sizeof(hl_langs)/sizeof(*hl_langs); ++i) {
+		for (sfx = hl_langs[i].sfx; *sfx != '\0'; sfx += l+1) {
+			l = strchr(sfx, ' ') - sfx;
+			if (base_l >= l &&
+			    strncmp(base+base_l-l, sfx, l) == 0) {
+				hl_lang = &hl_langs[i];
+				return;
+			}
+		}
+	}
+	if (lns_l != 0 && lns[0]->l > 2 && strncmp(lns[0]->str, "#!", 2) == 0 &&
+	    str_n_str(lns[0]->str, "sh", lns[0]->l, 0) != NULL)
+		hl_lang = &hl_langs[HL_SH_IDX];
+}
+
+/*
+ * Lex the line `l_y' that starts in the state `st' (see `hl_c').
+ * The attributes of its bytes are put in `at', unless it's `NULL'.
+ * --
+ * Lines longer than `HL_LN_MAX' are not highlighted, and they don't
+ * change the state.
+ */
+unsigned char
+hl_ln(size_t l_y, unsigned char st, unsigned char* at)
+{
+	if (lns[l_y]->l > HL_LN_MAX)
+		return st;
+	if (at != NULL)
+		memset(at, 0, lns[l_y]->l);
+	return hl_lang->lex(lns[l_y]->str, lns[l_y]->l, st, at);
+}
+
+/*
+ * Bring the end states of the lines before `to' up to date.
+ * --
+ * The lexing starts from the first line that may have changed
+ * (`hl_l').  Once a line ends in the same state as it used to, the
+ * lines below it are known to be right, and only the ones that have
+ * been changed themselves are lexed.  The first line whose start
+ * state turns out to be different is kept in `hl_chg' to be redrawn.
+ */
+void
+hl_sync(size_t to)
+{
+	/* Have the states converged. */
+	char conv;
+	unsigned char st;
+	
+	for (conv = 0; hl_l < to; ++hl_l) {
+		if (conv && !lns[hl_l]->hl_new)
+			continue;
+		st = hl_ln(hl_l, HL_ST(hl_l), NULL);
+		conv = st == lns[hl_l]->hl_st;
+		if (!conv && lns[hl_l]->hl_st != HL_ST_UNK &&
+		    hl_l+1 < hl_chg)
+			hl_chg = hl_l+1;
+		lns[hl_l]->hl_st = st;
+		lns[hl_l]->hl_new = 0;
+	}
+}
+
+/*
+ * If the editor's been invoked with a file path, then
+ * we need to read the contents of the file at this
+ * path.  If there's no file exists at this path, we
+ * just open an empty buffer (do not create a file now).
+ */
+void
+handle_filepath(char* path)
+{
+	/* File descriptor for a target file. */
+	int fd;
+	
+	/*
+	 * If file already exists, we open it for reading only,
+	 * and the read it, but if it doesn't we create it for
+	 * both reading and writing and do _not_ read it,
+	 * because it's empty and `lns' has already been
+	 * initialized.
 	 */
+	if (check_exists(path)) {
+		fd = open(path, O_RDONLY);
+		if (fd == -1)
+			err(1, "Can not open file at %s", path);
+		read_fd(fd);
+	}
+	else {
+		lns_l = 1;
+		mod = MOD_EDT;
+		goto set_path;
+	}
 	
+	if (close(fd) == -1)
+		err(1, "Can not close the file");
+set_path:
+	SET_FILEPATH(path);
+	hl_detect();
+}
+
+/*
+ * Print current editor mode: ``NAV'' or ``EDT''.  There's no need to
+ * print the ``CMD'' mode, because it uses the same line as status does.
+ * The views that are not worked in have no mode.
+ */
+void
+print_mod()
+{
+	MV_CURS_SF(ws_row+1, 1);
+	/* Erase the current mode. */
+	scr_str("   \r");
+	if (!vw_oth)
+		WR_REV_VID(mod == MOD_NAV ? "NAV" : "EDT", 3);
+	RST_CURS();
+}
+
+/*
+ * Display a current cursor coordinates.
+ * This function is the last one called in the `print_status',
+ * so it prints the trailing whitespaces to form an `RULER'
+ * characters long ruler.
+ */
+void
+print_pos()
+{
 	/*
-	 * Disable:
-	 *     `ECHO' and `ECHONL' - to not to echo things back.
-	 *     `ICANON' - read byte-by-byte instead of default line-by-line.
-	 *     `ISIG' - to turn off default keybinding for signals.
-	 *              I.e. `CTRL+C' for `SIGINT'.
+	 * Skip 3-characters long mode name.
 	 */
-	tos.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG);
-	
+	MV_CURS_SF(ws_row+1, 4);
+	ERS_LINE_FWD();
+	scr_at(AT_REV);
+	scr_pad(RULER-3-STATUS_GAP);
+	scr_at(0);
+	RST_CURS();
+	MV_CURS_SF(ws_row+1, 4);
+	scr_at(AT_REV);
+	scr_pad(STATUS_GAP);
+	scr_num(LN_Y+1);
+	scr_wr(", ", 2);
+	scr_num(LN_X+1);
+	if (mc_rec != 0) {
+		scr_str("  recording @");
+		scr_wr(&mc_rec, 1);
+	}
+	scr_at(0);
+	RST_CURS();
+}
+
+/*
+ * Print the editor status-line, where editor mode dwells.
+ * Every function is called here writes the text in reverse
+ * video mode and the last function prints an empty tail of
+ * whitespaces (in reverse mode too) to form an `RULER'
+ * characters long ruler.
+ */
+void
+print_status()
+{	
+	print_mod();
+	print_pos();
+}
+
+/*
+ * Redraw a ``CMD'' line with its current state (command that is
+ * currently typed here or a result of a command, that is displayed
+ * on the screen.
+ */
+void
+print_cmd()
+{
+	CLN_CMD();
 	/*
-	 * Disable:
-	 *     `IXON' - prevent software flow control.  These are the things
-	 *              like `CTRL+S' (freeze) and `CTRL+Q' (unfreeze).
-	 *     `ICRNL' - to not to map `CR' (`\r') to `NL' (`\n').
+	 * If right now there is a text printed as a result of a
+	 * previous command, we re-print that again, otherwise,
+	 * we print the command (not completed yet) that was in
+	 * the process of typing before we called this function.
 	 */
-	tos.c_iflag &= ~(IXON | ICRNL);
+	if (cmd_txt == NULL) {		
+		PRINT_CHAR(mod == MOD_SEA ? SEA_ESC : CMD_ESC);
+		/*
+		 * If we have found some match results, then we have
+		 * entered a search query and if we've entered it, it
+		 * means that `cmd' includes a ``\n'' in the end.  But
+		 * we _don't_ want to include it in `write', because it
+		 * will append a newline in the end, which will lead to
+		 * shifting all the lines down.  In case of _non_-search
+		 * mode, we don't care about newline in the end, because
+		 * right now there are no such ``cmd''s which save
+		 * the original prompt while giving some results.
+		 */
+		scr_wr(cmd, in_sea ? cmd_i-1 : cmd_i);
+	}
+	else
+		WR_REV_VID(cmd_txt, strlen(cmd_txt));
+}
+
+/*
+ * Read the compiled terminfo(5) entry for the terminal `TERM' and set
+ * `tcap' to the capabilities it has.  Without an entry, we assume the
+ * usual ones (`TC_DEFAULT'), unless it's something that obviously
+ * can't do much.
+ */
+void
+rd_tinfo()
+{
+	/* `TC_*' bits and `TI_*' indexes of the capabilities. */
+	static const int caps[][2] = {
+		{ TC_CSR, TI_CSR }, { TC_SU, TI_SU }, { TC_SD, TI_SD },
+		{ TC_IL, TI_IL }, { TC_DL, TI_DL }, { TC_ICH, TI_ICH },
+		{ TC_DCH, TI_DCH }, { TC_ECH, TI_ECH }, { TC_REP, TI_REP }
+	};
+	/* `KEY_*' and `TI_*' indexes of the keys. */
+	static const int keys[][2] = {
+		{ KEY_UP, TI_KCUU1 }, { KEY_DOWN, TI_KCUD1 },
+		{ KEY_RIGHT, TI_KCUF1 }, { KEY_LEFT, TI_KCUB1 },
+		{ KEY_HOME, TI_KHOME }, { KEY_END, TI_KEND },
+		{ KEY_PGUP, TI_KPP }, { KEY_PGDN, TI_KNP }
+	};
+	static const char* dirs[] = {
+		"/etc/terminfo", "/lib/terminfo", "/usr/share/terminfo",
+		"/usr/lib/terminfo", "/usr/local/share/terminfo"
+	};
+	char path[PATH_MAX];
+	unsigned char ti[8192];
+	/* Header: magic, sizes of names, booleans, numbers and strings. */
+	int hdr[5];
+	char* term;
+	char* home;
+	size_t i;
+	size_t off;
+	/* Where a string is and its length. */
+	size_t so;
+	size_t l;
+	ssize_t tl;
+	int fd;
+	
+	tcap = 0;
+	term = getenv("TERM");
+	if (term == NULL || *term == '\0' || strchr(term, '/') != NULL ||
+	    strcmp(term, "dumb") == 0)
+		return;
 	
 	/*
-	 * Disable:
-	 *     `OPOST' - to turn off output processing, so we need to manually
-	 *               send `\r\n' instead of just `\n' every time we want
-	 *               to print a new line.
+	 * Entries live in subdirectories named after their first letter
+	 * (or its hexadecimal code on some systems).
 	 */
-	tos.c_oflag &= ~OPOST;
+	fd = -1;
+	if (getenv("TERMINFO") != NULL) {
+		snprintf(path, sizeof(path), "%s/%c/%s", getenv("TERMINFO"),
+		    *term, term);
+		fd = open(path, O_RDONLY);
+	}
+	if (fd == -1 && (home = getenv("HOME")) != NULL) {
+		snprintf(path, sizeof(path), "%s/.terminfo/%c/%s", home,
+		    *term, term);
+		fd = open(path, O_RDONLY);
+	}
+	for (i = 0; fd == -1 && i < 2 * sizeof(dirs)/sizeof(*dirs); ++i) {
+		snprintf(path, sizeof(path), i % 2 ? "%s/%x/%s" : "%s/%c/%s",
+		    dirs[i/2], *term, term);
+		fd = open(path, O_RDONLY);
+	}
+	if (fd == -1) {
+		if (strncmp(term, "vt100", 5) != 0)
+			tcap = TC_DEFAULT;
+		return;
+	}
+	tl = read(fd, ti, sizeof(ti));
+	close(fd);
+	
+	if (tl < 12)
+		return;
+	for (i = 0; i < 5; ++i)
+		hdr[i] = ti[2*i] | ti[2*i+1] << 8;
+	if (hdr[0] != TI_MAGIC && hdr[0] != TI_MAGIC32)
+		return;
+	
+	/* Skip the names and booleans (padded to even) and numbers. */
+	off = 12 + hdr[1] + hdr[2];
+	off += off % 2;
+	off += hdr[3] * (hdr[0] == TI_MAGIC32 ? 4 : 2);
+	
+	/* A string is there unless its offset is negative. */
+	for (i = 0; i < sizeof(caps)/sizeof(*caps); ++i) {
+		if (caps[i][1] < hdr[4] &&
+		    off + 2*caps[i][1] + 1 < (size_t)tl &&
+		    !(ti[off + 2*caps[i][1] + 1] & 0x80))
+			tcap |= caps[i][0];
+	}
 	
 	/*
-	 * read(2) satisfies when either 1 byte has been read or
-	 * 100 ms have passed.  It will be very helpful for
-	 * handling (in our case, detecting and ignoring) ESCape
-	 * sequences (see `input_loop').
+	 * The strings themselves follow their offsets.  Only the ones
+	 * that begin with `ESC' are taken (without it, see `in_key').
 	 */
-	tos.c_cc[VMIN] = 1;
-	tos.c_cc[VTIME] = 1;
-	
-	/* Apply all changes we have just done. */
-	if (tcsetattr(STDOUT_FILENO, TCSANOW, &tos) == -1)
-		err(1, "Can not set terminal attributes");
+	for (i = 0; i < sizeof(keys)/sizeof(*keys); ++i) {
+		if (keys[i][1] >= hdr[4] ||
+		    off + 2*keys[i][1] + 1 >= (size_t)tl ||
+		    ti[off + 2*keys[i][1] + 1] & 0x80)
+			continue;
+		so = off + 2*hdr[4] +
+		    (ti[off + 2*keys[i][1]] | ti[off + 2*keys[i][1] + 1] << 8);
+		if (so >= (size_t)tl || ti[so] != ESC)
+			continue;
+		for (l = 0; l < TKEY_MAX-1 && so+1+l < (size_t)tl &&
+		    ti[so+1+l] != '\0'; ++l)
+			tkey[keys[i][0]][l] = ti[so+1+l];
+		/* Too long (or cut off) ones are left out. */
+		if (so+1+l >= (size_t)tl || ti[so+1+l] != '\0')
+			l = 0;
+		tkey[keys[i][0]][l] = '\0';
+	}
 }
 
 /*
- * Expand `lns' at the end.
- * Allocate space for:
- *     - `ln' pointer.
- *     - `ln' struct.
- *     - `ln->str' string.
- * 
+ * Find out what the terminal supports: the capabilities it has in
+ * terminfo(5) and whether it knows the synchronized update mode
+ * (see `sync_upd').
+ * --
+ * The query for it is followed by the query for primary attributes,
+ * which every terminal answers.  So once we've got the latter, we
+ * know there's nothing more to wait for.
  */
 void
-expand_lns()
+query_term()
 {
-	size_t i;
+	struct pollfd pfd;
+	/* The answers of the terminal. */
+	char ans[128];
+	size_t ans_l;
+	ssize_t arb;
+	char* p;
 	
-	lns = srealloc(lns, (lns_sz += LNS_EXPAND) * sizeof(struct ln*));
+	rd_tinfo();
+	
+	if (write(STDOUT_FILENO, SYNC_UPD_QUERY, sizeof(SYNC_UPD_QUERY)-1) <
+	    0)
+		return;
+	
+	pfd.fd = STDIN_FILENO;
+	pfd.events = POLLIN;
+	ans_l = 0;
+	while (ans_l < sizeof(ans)-1 &&
+	    poll(&pfd, 1, QUERY_TIMEOUT) == 1 &&
+	    (arb = read(STDIN_FILENO, ans+ans_l, sizeof(ans)-1-ans_l)) > 0) {
+		ans_l += arb;
+		/* The primary attributes answer ends with `c'. */
+		if (ans[ans_l-1] == 'c')
+			break;
+	}
+	ans[ans_l] = '\0';
 	
 	/*
-	 * Initialize objects for new lines.
+	 * The answer is `CSI ? 2026 ; N $ y', where `N' is `1' or `2' if
+	 * the mode is supported (set or reset), `3' if it is always set.
 	 */
-	for (i = 0; i < LNS_EXPAND; ++i)
-		INIT_LN(i+lns_l);
+	if ((p = strstr(ans, "?2026;")) != NULL)
+		sync_upd = p[6] >= '1' && p[6] <= '3' && p[7] == '$';
 }
 
 /*
- * Check if file at `path' does exist.
+ * Initial terminal setup before starting printing the text out:
+ *     - Open it for non-blocking output (see `out_fd').
+ *     - Find out its features and what its keys send.
+ *     - Turn bracketed paste on.
+ *     - Clear the screen.
+ *     - Print the headline out.
+ */
+void
+setup_terminal()
+{
+	char* tty;
+	
+	if ((tty = ttyname(STDOUT_FILENO)) != NULL &&
+	    (out_fd = open(tty, O_WRONLY | O_NONBLOCK | O_NOCTTY)) == -1)
+		out_fd = STDOUT_FILENO;
+	query_term();
+	esc_delay = getenv("ESCDELAY") != NULL ? atoi(getenv("ESCDELAY")) :
+	    ESC_DELAY;
+	ob_str(PST_ON_CMD);
+	ERS_ALL();
+	print_status();
+}
+
+/*
+ * Get next tab stop from the column `col'.
+ */
+size_t
+nx_tab(size_t col)
+{
+	return TABSIZE * ((col-1)/(TABSIZE) + 1) + 1;
+}
+
+/*
+ * Is the line `l_y' all ASCII.  It's checked once after every change
+ * of the line, and it keeps the column math of such a line as cheap
+ * as it was before UTF-8.
  */
 char
-check_exists(char* path)
+ln_ascii(size_t l_y)
 {
-	struct stat st;
+	if (lns[l_y]->ascii == -1)
+		lns[l_y]->ascii = is_ascii(lns[l_y]->str, lns[l_y]->l);
+	return lns[l_y]->ascii;
+}
+
+/*
+ * Step over the character of the line `l_y' at its byte `x', moving
+ * the column `col' past it.  Zero width characters that follow it are
+ * taken as a part of it.
+ * --
+ * Returns the byte of the next character.
+ */
+size_t
+ln_nx(size_t l_y, size_t x, size_t* col)
+{
+	struct ln* ln;
+	long cp;
+	size_t n;
+	
+	ln = lns[l_y];
+	if (ln->str[x] == '\t') {
+		*col = nx_tab(*col);
+		++x;
+	}
+	else if ((unsigned char)ln->str[x] < 0x80) {
+		++*col;
+		++x;
+	}
+	else {
+		x += u8_dec(ln->str+x, ln->l-x, &cp);
+		*col += cp_wid(cp);
+	}
+	while (x < ln->l && (unsigned char)ln->str[x] >= 0x80) {
+		n = u8_dec(ln->str+x, ln->l-x, &cp);
+		if (cp_wid(cp) != 0)
+			break;
+		x += n;
+	}
+	
+	return x;
+}
+
+/*
+ * Find the start of the character of the line `l_y' that precedes
+ * its byte `x'.  The reverse of `ln_nx'.
+ */
+size_t
+ln_pr(size_t l_y, size_t x)
+{
+	struct ln* ln;
+	long cp;
+	size_t p;
+	
+	ln = lns[l_y];
+	do {
+		p = x-1;
+		while (p > 0 && x-p < UTF8_MAX && IS_U8_CONT(ln->str[p]))
+			--p;
+		/* Bytes that are no character are a character each. */
+		if (u8_dec(ln->str+p, ln->l-p, &cp) != x-p) {
+			p = x-1;
+			cp = -1;
+		}
+		x = p;
+	} while (x != 0 && cp_wid(cp) == 0);
+	
+	return x;
+}
+
+/*
+ * Find out the column checkpoints of the line `l_y' up to the one at
+ * its character `x', but not further than the first one at or after
+ * the column `col'.  A checkpoint is put on the first character
+ * boundary at or after each `CK_STEP' bytes.
+ * --
+ * Returns the number of checkpoints known.
+ */
+size_t
+ln_ck(size_t l_y, size_t x, size_t col)
+{
+	struct ln* ln;
+	struct ckpt ck;
+	size_t end;
+	char ascii;
+	
+	ln = lns[l_y];
+	x = CLAMP_MAX(x, ln->l);
+	ascii = ln_ascii(l_y);
+	if (ln->ck_l == 0) {
+		ck.x = 0;
+		ck.col = 1;
+	}
+	else
+		ck = ln->ck[ln->ck_l-1];
+	while ((end = (ln->ck_l+1) * CK_STEP) <= x && ck.col < col) {
+		if (ascii) {
+			for (; ck.x < end; ++ck.x) {
+				if (ln->str[ck.x] != '\t')
+					++ck.col;
+				else
+					ck.col = nx_tab(ck.col);
+			}
+		}
+		else {
+			while (ck.x < end)
+				ck.x = ln_nx(l_y, ck.x, &ck.col);
+		}
 		
-	return stat(path, &st) != -1;
+		if (ln->ck_l == ln->ck_sz) {
+			ln->ck_sz = ln->ck_sz == 0 ? 16 : ln->ck_sz*2;
+			ln->ck = srealloc(ln->ck,
+			    ln->ck_sz * sizeof(struct ckpt));
+		}
+		ln->ck[ln->ck_l++] = ck;
+	}
+	
+	return ln->ck_l;
 }
 
 /*
- * Read contents of a file at file descriptor `fd' into buffer.
+ * On which column does this (`l_x') character in
+ * this (`l_y') line resides.
  * --
- * The `fd' is _not_ closed in this function.
+ * The reverse of `col2char'.
  * --
- * This function is ought to be called only when we're sure
- * that `lns' has at least been initialized.
+ * The walk starts from the closest column checkpoint before `l_x',
+ * so it's never much longer than `CK_STEP' bytes.
  */
-void
-read_fd(int fd)
+size_t
+char2col(size_t l_y, size_t l_x)
 {
-	/* Actually read bytes. */
-	ssize_t arb;
-	int i;
+	/* Imaginary column. */
+	size_t curs_tmp;
+	/* The index of a character within current `ln'. */
+	size_t x;
+	/* Bounds of the binary search within the checkpoints. */
+	size_t lo;
+	size_t hi;
+	size_t mid;
 	
-	i = -1;
+	x = 0;
+	curs_tmp = 1;
+	if (l_x >= CK_STEP) {
+		lo = 0;
+		hi = ln_ck(l_y, l_x, (size_t)-1);
+		while (lo < hi) {
+			mid = lo + (hi-lo) / 2;
+			if (lns[l_y]->ck[mid].x <= l_x)
+				lo = mid+1;
+			else
+				hi = mid;
+		}
+		if (lo != 0) {
+			x = lns[l_y]->ck[lo-1].x;
+			curs_tmp = lns[l_y]->ck[lo-1].col;
+		}
+	}
+	if (ln_ascii(l_y)) {
+		for (; x < l_x; ++x) {
+			if (lns[l_y]->str[x] != '\t')
+				++curs_tmp;
+			else
+				curs_tmp = nx_tab(curs_tmp);
+		}
+	}
+	else {
+		while (x < l_x)
+			x = ln_nx(l_y, x, &curs_tmp);
+	}
 	
-	while ((arb = read(fd, &buf, IOBUF)) > 0) {
-		for (i = 0; i < arb; ++i) {
-			if (buf[i] == '\n') {
-				lns_l++;
-				if (lns_l == lns_sz)
-					expand_lns();
-				continue;
-			}
-			
-			if (lns[lns_l]->l == lns[lns_l]->sz)
-				EXPAND_LN(lns_l, LN_EXPAND);
-			
-			lns[lns_l]->str[lns[lns_l]->l] = buf[i];
-			lns[lns_l]->l++;
+	return curs_tmp;
+}
+
+/*
+ * What character in `l_y' line is at `col' screen column.
+ * If column `col' the actual length of a string, then
+ * assume the request is for the last character string.
+ * Due to this, it also puts the actual column number
+ * (because it doesn't always match the passed `col')
+ * in the `res_col' (unless it is `NULL').
+ * --
+ * The reverse of `char2col'.
+ * --
+ * The walk starts from the last column checkpoint before `col' (that
+ * is found with a binary search), see `char2col'.
+ */
+size_t
+col2char(size_t l_y, size_t col, size_t* res_col)
+{
+	size_t curs_tmp;
+	size_t nx_col;
+	size_t x;
+	size_t nx_x;
+	/* Bounds of the binary search within the checkpoints. */
+	size_t lo;
+	size_t hi;
+	size_t mid;
+	char ascii;
+	
+	x = 0;
+	curs_tmp = 1;
+	if (lns[l_y]->l >= CK_STEP) {
+		lo = 0;
+		hi = ln_ck(l_y, lns[l_y]->l, col);
+		while (lo < hi) {
+			mid = lo + (hi-lo) / 2;
+			if (lns[l_y]->ck[mid].col < col)
+				lo = mid+1;
+			else
+				hi = mid;
+		}
+		if (lo != 0) {
+			x = lns[l_y]->ck[lo-1].x;
+			curs_tmp = lns[l_y]->ck[lo-1].col;
 		}
 	}
 	
-	if (arb == -1)
-		err(1, "Error during reading a file");
-	
-	/*
-	 * In case the file is not terminated with a newline,
-	 * we 'insert' that newline, so that it would be written
-	 * back in the file.
-	 *
-	 * `i' can't be zero here.
-	 */
-	if (i == -1 || buf[i-1] != '\n') {
-		lns_l++;
-		dirty = 1;
+	ascii = ln_ascii(l_y);
+	while (curs_tmp < col && x < lns[l_y]->l) {
+		if (ascii && lns[l_y]->str[x] != '\t') {
+			++curs_tmp;
+			++x;
+			continue;
+		}
+		nx_col = curs_tmp;
+		nx_x = ln_nx(l_y, x, &nx_col);
+		/*
+		 * Handle the case, when there is a tab-stop-gap
+		 * _below_ our cursor position.  We decide where
+		 * to go: to the begining of a tab stop or to the
+		 * end of it depending on which is closer to us.
+		 * A wide character is always gone to the start of.
+		 */
+		if (nx_col > col) {
+			/* Go to the tab stop start. */
+			if (lns[l_y]->str[x] != '\t' ||
+			    col-curs_tmp < nx_col-col) {
+				if (res_col != NULL)
+					*res_col = curs_tmp;
+				return x;
+			}
+			/* Go to the tab stop end. */
+			else {
+				if (res_col != NULL)
+					*res_col = nx_col;
+				return nx_x;
+			}
+		}
+		curs_tmp = nx_col;
+		x = nx_x;
 	}
 	
-	if (i == -1)
-		mod = MOD_EDT;
+	if (res_col != NULL)
+		*res_col = curs_tmp;
+	return x;
 }
 
 /*
- * If the editor's been invoked with a file path, then
- * we need to read the contents of the file at this
- * path.  If there's no file exists at this path, we
- * just open an empty buffer (do not create a file now).
+ * Find the matches of the search pattern `fnd' in the line `l_y', put
+ * their offsets in `lns[l_y]->ma' and return how many there are.
+ * --
+ * They are cached: the line is searched again only if it has changed
+ * (see `TOUCH_LN') or the pattern has, since the last time.
  */
-void
-handle_filepath(char* path)
+size_t
+ma_ln(size_t l_y)
 {
-	/* File descriptor for a target file. */
-	int fd;
+	struct ln* ln;
+	char* mat_p;
+	size_t off;
 	
-	/*
-	 * If file already exists, we open it for reading only,
-	 * and the read it, but if it doesn't we create it for
-	 * both reading and writing and do _not_ read it,
-	 * because it's empty and `lns' has already been
-	 * initialized.
-	 */
-	if (check_exists(path)) {
-		fd = open(path, O_RDONLY);
-		if (fd == -1)
-			err(1, "Can not open file at %s", path);
-		read_fd(fd);
-	}
-	else {
-		lns_l = 1;
-		mod = MOD_EDT;
-		goto set_path;
+	if (fnd_i != ma_fnd_i || IS_I_FLAG != ma_i_flag ||
+	    memcmp(fnd, ma_fnd, fnd_i) != 0) {
+		memcpy(ma_fnd, fnd, fnd_i);
+		ma_fnd_i = fnd_i;
+		ma_i_flag = IS_I_FLAG;
+		++ma_gen;
 	}
 	
-	if (close(fd) == -1)
-		err(1, "Can not close the file");
-set_path:
-	SET_FILEPATH(path);
+	ln = lns[l_y];
+	if (ln->ma_gen == ma_gen)
+		return ln->ma_l;
+	
+	ln->ma_l = 0;
+	ln->ma_gen = ma_gen;
+	off = 0;
+	while (fnd_i != 0 && (mat_p = str_n_str(ln->str+off, fnd,
+	    ln->l-off, IS_I_FLAG)) != NULL) {
+		if (ln->ma_l == ln->ma_sz) {
+			ln->ma_sz = ln->ma_sz == 0 ? 4 : ln->ma_sz * 2;
+			ln->ma = srealloc(ln->ma, ln->ma_sz * sizeof(size_t));
+		}
+		off = mat_p - ln->str;
+		ln->ma[ln->ma_l++] = off;
+		off += fnd_i;
+	}
+	return ln->ma_l;
 }
 
 /*
- * Print current editor mode: ``NAV'' or ``EDT''.  There's no need to
- * print the ``CMD'' mode, because it uses the same line as status does.
+ * Does the filter leave the line `l_y' out, i.e. it doesn't have the
+ * pattern `fl_pat' in it.  The cursor line is let through, so that
+ * the line being edited doesn't go away.
+ * --
+ * It is cached like `ma_ln' does: a line is looked at again only if
+ * it has changed or the filter has.
  */
-void
-print_mod()
+char
+fl_ln(size_t l_y)
 {
-	MV_CURS_SF(ws_row+1, 1);
-	/* Erase the current mode. */
-	dprintf(STDOUT_FILENO, "   \r");
-	WR_REV_VID("%s", mod == MOD_NAV ? "NAV" : "EDT");
-	RST_CURS();
+	struct ln* ln;
+	
+	ln = lns[l_y];
+	if (ln->fl_gen != fl_gen) {
+		ln->fl_out = l_y != LN_Y &&
+		    str_n_str(ln->str, fl_pat, ln->l, 0) == NULL;
+		ln->fl_gen = fl_gen;
+	}
+	return ln->fl_out;
 }
 
 /*
- * Display a current cursor coordinates.
- * This function is the last one called in the `print_status',
- * so it prints the trailing whitespaces to form an `RULER'
- * characters long ruler.
+ * Draw the line `l_y' from its character `l_x' on, but not more of it
+ * than can fit the screen width.  It's highlighted, if the syntax
+ * highlighting is on: the states of the lines above are found out
+ * first, but only as far as they are not known yet.  All the search
+ * matches are in reverse video while searching, and the current one
+ * (at `mat_off' of the line `mat_i') is underlined as well.
  */
 void
-print_pos()
+dpl_span(size_t l_y, size_t l_x)
 {
-	/*
-	 * Skip 3-characters long mode name.
-	 */
-	MV_CURS_SF(ws_row+1, 4);
-	ERS_LINE_FWD();
-	WR_REV_VID("%*s", RULER-3-STATUS_GAP, "");
-	RST_CURS();
-	MV_CURS_SF(ws_row+1, 4);
-	WR_REV_VID("%*s", STATUS_GAP, "");
-	WR_REV_VID("%zu, %zu", LN_Y+1, LN_X+1);
-	RST_CURS();
+	size_t n;
+	size_t i;
+	size_t j;
+	/* Is the line highlighted, and its search matches. */
+	char hl;
+	size_t* ma;
+	size_t ma_l;
+	size_t k;
+	/* The end of the current run of the same attributes. */
+	size_t e;
+	char in;
+	
+	n = CLAMP_MAX(lns[l_y]->l-l_x, UTF8_MAX*ws_col);
+	hl = HL_IS_ON(l_y);
+	ma_l = in_sea ? ma_ln(l_y) : 0;
+	if (!hl && ma_l == 0) {
+		scr_wr(lns[l_y]->str+l_x, n);
+		return;
+	}
+	
+	if (hl) {
+		hl_sync(l_y);
+		hl_ln(l_y, HL_ST(l_y), hl_at);
+	}
+	/* Skip the matches before `l_x' with a binary search. */
+	ma = lns[l_y]->ma;
+	i = 0;
+	k = ma_l;
+	while (i < k) {
+		j = i + (k-i) / 2;
+		if (ma[j]+fnd_i <= l_x)
+			i = j+1;
+		else
+			k = j;
+	}
+	k = i;
+	for (i = l_x; i < l_x+n; i = j) {
+		while (k < ma_l && ma[k]+fnd_i <= i)
+			++k;
+		in = k < ma_l && ma[k] <= i;
+		e = k == ma_l ? l_x+n : in ? ma[k]+fnd_i : ma[k];
+		e = CLAMP_MAX(e, l_x+n);
+		for (j = i+1; j < e && (!hl || hl_at[j] == hl_at[i]); ++j)
+			;
+		scr_at((hl ? hl_at[i] : 0) | (in ? AT_REV : 0) |
+		    (in && l_y == mat_i && ma[k] == mat_off ? AT_UL : 0));
+		scr_wr(lns[l_y]->str+i, j-i);
+	}
+	scr_at(0);
 }
 
 /*
- * Print the editor status-line, where editor mode dwells.
- * Every function is called here writes the text in reverse
- * video mode and the last function prints an empty tail of
- * whitespaces (in reverse mode too) to form an `RULER'
- * characters long ruler.
+ * Draw the part of the line `l_y' that is visible with the horizontal
+ * offset `off' (see `off_x'), on the row of the virtual cursor.
  */
 void
-print_status()
-{	
-	print_mod();
-	print_pos();
+dpl_row(size_t l_y, size_t off)
+{
+	/* The first drawn character, and its column. */
+	size_t x;
+	size_t col;
+	
+	scr_mv(vc_y, 1);
+	x = 0;
+	if (off != 0) {
+		x = col2char(l_y, off+1, &col);
+		/*
+		 * A wide character that is cut by the left edge
+		 * of the screen, only its blank right half is seen.
+		 */
+		if (col <= off && x != lns[l_y]->l) {
+			x = ln_nx(l_y, x, &col);
+			scr_wr(" ", 1);
+		}
+	}
+	dpl_span(l_y, x);
 }
 
 /*
- * Redraw a ``CMD'' line with its current state (command that is
- * currently typed here or a result of a command, that is displayed
- * on the screen.
+ * Draw the line `l_y' from its character `l_x' on (the virtual cursor
+ * is expected to be at it).
+ * --
+ * With syntax highlighting an edit may change the colors of the text
+ * before `l_x' as well, so the whole row is drawn then.  Only the
+ * cells that do change are sent to the terminal anyway.
  */
 void
-print_cmd()
+dpl_ln(size_t l_y, size_t l_x)
 {
-	CLN_CMD();
 	/*
-	 * If right now there is a text printed as a result of a
-	 * previous command, we re-print that again, otherwise,
-	 * we print the command (not completed yet) that was in
-	 * the process of typing before we called this function.
+	 * The rows below may move, all of them are drawn by `wr_fix'.
+	 * So is the line with the mark of a fold after it.
 	 */
-	if (cmd_txt == NULL) {		
-		PRINT_CHAR(mod == MOD_SEA ? SEA_ESC : CMD_ESC);
-		/*
-		 * If we have found some match results, then we have
-		 * entered a search query and if we've entered it, it
-		 * means that `cmd' includes a ``\n'' in the end.  But
-		 * we _don't_ want to include it in `write', because it
-		 * will append a newline in the end, which will lead to
-		 * shifting all the lines down.  In case of _non_-search
-		 * mode, we don't care about newline in the end, because
-		 * right now there are no such ``cmd''s which save
-		 * the original prompt while giving some results.
-		 */
-		write(STDOUT_FILENO, &cmd, in_sea ? cmd_i-1 : cmd_i);
+	if (wrap || lns[l_y]->fd_n != 0)
+		wr_dpl = 1;
+	else if (HL_IS_ON(l_y)) {
+		ERS_LINE_ALL();
+		dpl_row(l_y, off_x);
 	}
 	else
-		WR_REV_VID("%s", cmd_txt);
+		dpl_span(l_y, l_x);
 }
 
 /*
- * Initial terminal setup before starting printing the text out:
- *     - Clear the screen.
- *     - Print the headline out.
+ * Display the text with the long lines soft wrapped: every line takes
+ * as many rows as it needs (and one more for the cursor after its
+ * end, if the last one is full), the screen starts at the row `off_r'
+ * of the line `off_y'.  The folded lines take none, the line they are
+ * folded under is followed by `FD_MARK' and their number.
  */
 void
-setup_terminal()
+dpl_wr_pg()
 {
-	ERS_ALL();
-	print_status();
+	size_t i;
+	/* A row of a line, and the number of them. */
+	size_t r;
+	size_t n;
+	size_t col;
+	US row;
+	US first;
+	
+	MV_CURS_SF(1, 1);
+	ERS_FWD();
+	
+	row = 1;
+	/* See `dpl_pg'. */
+	if (lns_l == 0)
+		row++;
+	for (i = off_y, r = off_r; i < lns_l && row <= ws_row; ++i, r = 0) {
+		if (LN_HID(i))
+			continue;
+		col = char2col(i, lns[i]->l);
+		n = wrap ? WR_ROWS(col) : 1;
+		for (first = row; r < n && row <= ws_row; ++r, ++row) {
+			scr_mv(row, 1);
+			if (!wrap)
+				dpl_row(i, off_x);
+			else {
+				dpl_row(i, r * wrap_w);
+				if (wrap_w < ws_col)
+					scr_blank(SCR_IDX(row, wrap_w+1),
+					    SCR_IDX(row, ws_col+1));
+			}
+		}
+		if (lns[i]->fd_n == 0)
+			continue;
+		if (wrap)
+			col -= (n-1) * wrap_w;
+		else
+			col = col > off_x ? col - off_x : 1;
+		/* The mark is there if the end of the line is seen. */
+		if (r == n && row > first && col < ws_col) {
+			scr_mv(row-1, col+1);
+			scr_at(AT_REV);
+			scr_str(FD_MARK " ");
+			scr_num(lns[i]->fd_n);
+			scr_str(" lines ");
+			scr_at(0);
+		}
+		i += lns[i]->fd_n;
+	}
+	for (; row <= ws_row; ++row) {
+		scr_mv(row, 1);
+		scr_str(EMPT_LN_MARK);
+	}
+	
+	RST_CURS();
+	
+	if (mod != MOD_CMD && mod != MOD_SEA)
+		print_status();
 }
 
 /*
  * Display the text so that it fits in one screen.
  * The print starts from the current vertical line offset `from'.
+ * Only the columns of lines that are visible with the current
+ * horizontal offset `off_x' are drawn.
+ * --
+ * With the soft wrap or folds the whole screen is drawn by `dpl_wr_pg'.
  */
 void
 dpl_pg(US from)
@@ -782,6 +4618,11 @@ dpl_pg(US from)
 	US empt_num;
 	size_t off;
 	
+	if (WR_MAP) {
+		dpl_wr_pg();
+		return;
+	}
+	
 	off = off_y + from;
 	ln_num = lns_l - off;
 	
@@ -799,8 +4640,8 @@ dpl_pg(US from)
 	}
 	
 	for (i = off; i < end; ++i) {
-		write(STDOUT_FILENO, lns[i]->str, lns[i]->l);
-		write(STDOUT_FILENO, "\n\r", 2);
+		dpl_row(i, off_x);
+		scr_wr("\n\r", 2);
 	}
 	
 	/*
@@ -818,7 +4659,7 @@ dpl_pg(US from)
 	 * Print empty lines, if any.
 	 */
 	for (i = 0; i < empt_num; ++i)
-		dprintf(STDOUT_FILENO, "%s\n\r", EMPT_LN_MARK);
+		scr_str(EMPT_LN_MARK "\n\r");
 	
 	RST_CURS();
 	
@@ -827,101 +4668,333 @@ dpl_pg(US from)
 }
 
 /*
- * Set current mode and update its name in the head line.
+ * Redraw the visible lines that have been drawn in a start state that
+ * is not right anymore, after the edits have been done.
  */
 void
-set_mod(char m)
+hl_upd()
 {
-	mod = m;
-	if (mod != MOD_CMD && mod != MOD_SEA)
-		print_mod();
+	size_t end;
+	
+	if (hl_lang == NULL || !hl_on)
+		return;
+	
+	end = CLAMP_MAX(off_y + ws_row, lns_l);
+	if (end != 0)
+		hl_sync(end-1);
+	if (hl_chg < end)
+		dpl_pg(hl_chg > off_y ? hl_chg-off_y : 0);
+	hl_chg = (size_t)-1;
 }
 
 /*
- * Get next tab stop from the column `col'.
+ * Add `d' rows to the line `i' in the tree `wr_fw' (`d' may be
+ * a negative number wrapped around, the sums wrap back).
  */
-US
-nx_tab(US col)
+void
+fw_add(size_t i, size_t d)
 {
-	return TABSIZE * ((col-1)/(TABSIZE) + 1) + 1;
+	for (++i; i <= wr_fw_l; i += i & -i)
+		wr_fw[i] += d;
 }
 
 /*
- * On which column does this (`l_x') character in
- * this (`l_y') line resides.
+ * Get the number of rows the lines before `i' take.
+ */
+size_t
+fw_sum(size_t i)
+{
+	size_t s;
+	
+	for (s = 0; i > 0; i -= i & -i)
+		s += wr_fw[i];
+	return s;
+}
+
+/*
+ * Find the line that the row `r' (counting from the first row of the
+ * text) belongs to, and put the row of that line in `res_r'.
+ */
+size_t
+fw_find(size_t r, size_t* res_r)
+{
+	size_t i;
+	size_t b;
+	
+	for (b = 1; b*2 <= wr_fw_l; b *= 2)
+		;
+	for (i = 0; wr_fw_l != 0 && b > 0; b /= 2) {
+		if (i+b <= wr_fw_l && wr_fw[i+b] <= r) {
+			i += b;
+			r -= wr_fw[i];
+		}
+	}
+	*res_r = r;
+	return i;
+}
+
+/*
+ * Build the tree `wr_fw' of the rows of the lines from `lo' on; the
+ * ones before it are as they were.  The last columns of the lines that
+ * have changed are found out first (if they are wrapped).
  * --
- * The reverse of `col2char'.
+ * Every node is the line of its own and the nodes right below it,
+ * which are either built already or are before `lo'.  So it takes
+ * about as long as the number of lines built.
+ */
+void
+wr_bld(size_t lo)
+{
+	size_t i;
+	size_t b;
+	
+	/* It grows as `lns' does, not line by line. */
+	if (wr_fw_sz < lns_l+1) {
+		wr_fw_sz = lns_sz+1;
+		wr_fw = srealloc(wr_fw, wr_fw_sz * sizeof(size_t));
+	}
+	wr_fw_l = lns_l;
+	for (i = lo+1; i <= lns_l; ++i) {
+		if (wrap && lns[i-1]->wr_new) {
+			lns[i-1]->wr_end = char2col(i-1, lns[i-1]->l);
+			lns[i-1]->wr_new = 0;
+		}
+		wr_fw[i] = WR_LN(i-1);
+		for (b = 1; b < (i & -i); b *= 2)
+			wr_fw[i] += wr_fw[i-b];
+	}
+}
+
+/*
+ * Bring the rows of the lines that have changed up to date in the
+ * tree.  From the first line that has been moved by inserting or
+ * removing lines on, it is built anew.
+ */
+void
+wr_upd()
+{
+	size_t i;
+	size_t lo;
+	size_t end;
+	size_t rows;
+	
+	lo = wr_mv;
+	if (wr_fw_l != lns_l)
+		lo = CLAMP_MAX(lo, CLAMP_MAX(wr_fw_l, lns_l));
+	
+	/*
+	 * Without the soft wrap or the filter every line takes one row
+	 * anyway.  The rows a line took are the ones the tree has.
+	 * The lines before `lo' are where they were in the tree.
+	 */
+	end = wrap || fl_l != 0 ? CLAMP_MAX(wr_hi+1, lns_l) : 0;
+	end = CLAMP_MAX(end, lo);
+	for (i = wr_lo; i < end; ++i) {
+		if (!lns[i]->wr_new)
+			continue;
+		rows = fw_sum(i+1) - fw_sum(i);
+		if (wrap) {
+			lns[i]->wr_end = char2col(i, lns[i]->l);
+			lns[i]->wr_new = 0;
+		}
+		fw_add(i, WR_LN(i) - rows);
+	}
+	if (lo != (size_t)-1)
+		wr_bld(lo);
+	wr_mv = (size_t)-1;
+	wr_lo = (size_t)-1;
+	wr_hi = 0;
+}
+
+/*
+ * Let the line `i' through the filter, even if it doesn't match.
+ */
+void
+fl_show(size_t i)
+{
+	if (!FL_OUT(i))
+		return;
+	lns[i]->fl_out = 0;
+	if (i < wr_mv && i < wr_fw_l)
+		fw_add(i, WR_LN(i));
+}
+
+/*
+ * Get the screen row of the first row of the line `l_y' (that is not
+ * above the screen) with the soft wrap.
+ */
+size_t
+wr_scr_row(size_t l_y)
+{
+	return fw_sum(l_y) - fw_sum(off_y) - off_r + 1;
+}
+
+/*
+ * Get the screen column for the column `col' of the current line.
+ * If it is not visible, scroll the screen horizontally first, so
+ * that it is in the middle of the screen (or as close to it as
+ * tab stops let it be), and redraw it.  With the soft wrap it's
+ * the column within the row of the line that `col' is at.
  */
 US
-char2col(size_t l_y, size_t l_x)
+scrl_to_col(size_t col)
 {
-	/* Imaginary column. */
-	US curs_tmp;
-	/* The index of a character within current `ln'. */
-	size_t x;
+	/* The cursor row is found by `wr_fix'. */
+	if (wrap) {
+		off_x = (col-1) / wrap_w * wrap_w;
+		return col - off_x;
+	}
+	if (col <= off_x || col > off_x + ws_col) {
+		off_x = col > ws_col/2 ? col-1 - ws_col/2 : 0;
+		off_x -= off_x % TABSIZE;
+		DPL_PG();
+	}
 	
-	x = 0;
-	curs_tmp = 1;
-	while (x != l_x) {
-		if (lns[l_y]->str[x] != '\t')
-			++curs_tmp;
-		else
-			curs_tmp = nx_tab(curs_tmp);
-		++x;
+	return col - off_x;
+}
+
+/*
+ * Put the soft wrapped (or folded) screen in order after the keys have
+ * been handled: bring the rows of the changed lines up to date, move
+ * the top of the screen so that the cursor is seen (or centered, after
+ * `jmp_ln') and find the cursor on the screen.  The screen is redrawn
+ * if it's needed.
+ * --
+ * The nav functions move the cursor by lines and columns as if every
+ * line took one row, and this is what makes it right.  A cursor that
+ * has gone into a fold is taken past it, or to the line it's folded
+ * under if it was going up (and so for the lines filtered out).
+ */
+void
+wr_fix()
+{
+	/* The cursor line and its column. */
+	size_t ly;
+	size_t col;
+	/* The row of the cursor and of the top of the screen in the text. */
+	size_t r;
+	size_t t;
+	size_t y;
+	size_t rr;
+	US x;
+	
+	if (!WR_MAP || lns_l == 0)
+		return;
+	
+	wr_upd();
+	/*
+	 * If there's nothing the filter lets through, the cursor line
+	 * is (or the line it is folded under).
+	 */
+	if (fw_sum(lns_l) == 0) {
+		for (ly = LN_Y; lns[ly]->fd_hid; --ly)
+			;
+		fl_show(ly);
+	}
+	ly = LN_Y;
+	if (LN_HID(ly)) {
+		col = char2col(ly, LN_X);
+		r = fw_sum(ly);
+		ly = fw_find(r != 0 && (ly < wr_ln || r == fw_sum(lns_l)) ?
+		    r-1 : r, &rr);
+		ln_x = col2char(ly, col, NULL);
 	}
+	wr_ln = ly;
+	if (off_y != wr_top_ln || !wrap)
+		off_r = 0;
+	off_r = CLAMP_MAX(off_r, WR_ROWS(lns[off_y]->wr_end) - 1);
+	
+	col = char2col(ly, LN_X);
+	r = fw_sum(ly) + (wrap ? (col-1) / wrap_w : 0);
+	t = fw_sum(off_y) + off_r;
+	if (wr_ctr)
+		t = r > ws_row/2 ? r - ws_row/2 : 0;
+	else if (wr_bot)
+		t = r >= ws_row ? r - ws_row + 1 : 0;
+	else if (r < t)
+		t = r;
+	else if (r >= t + ws_row)
+		t = r - ws_row + 1;
+	wr_ctr = 0;
+	wr_bot = 0;
+	
+	y = fw_find(t, &rr);
+	if (y != off_y || rr != off_r) {
+		off_y = y;
+		off_r = rr;
+		wr_dpl = 1;
+	}
+	wr_top_ln = off_y;
+	ln_y = ly - off_y;
+	x = scrl_to_col(col);
 	
-	return curs_tmp;
+	if (wr_dpl) {
+		wr_dpl = 0;
+		DPL_PG();
+	}
+	if (mod == MOD_CMD || mod == MOD_SEA) {
+		nav_curs_x = x;
+		nav_curs_y = r - t + 1;
+	}
+	else {
+		curs_x = x;
+		curs_y = r - t + 1;
+		SYNC_CURS();
+	}
 }
 
 /*
- * What character in `l_y' line is at `col' screen column.
- * If column `col' the actual length of a string, then
- * assume the request is for the last character string.
- * Due to this, it also puts the actual column number
- * (because it doesn't always match the passed `col')
- * in the `res_col'.
- * --
- * The reverse of `char2col'.
+ * Scroll the soft wrapped (or folded) text `n' rows down (if `dwn' is
+ * set) or up.
+ * The cursor stays on its place, unless it would leave the screen: it
+ * is put at the start of the first (or the last) visible row then.
  */
-size_t
-col2char(size_t l_y, US col, US* res_col)
+void
+wr_scrl(size_t n, char dwn)
 {
-	US curs_tmp;
-	US nx_tab_col;
-	size_t x;
+	size_t ly;
+	size_t r;
+	size_t t;
+	size_t tot;
+	size_t rr;
+	
+	wr_upd();
+	tot = fw_sum(lns_l);
+	t = fw_sum(off_y) + off_r;
+	if (dwn) {
+		if (t + ws_row >= tot)
+			return;
+		t = CLAMP_MAX(t+n, tot - ws_row);
+	}
+	else {
+		if (t == 0)
+			return;
+		t = t > n ? t-n : 0;
+	}
 	
-	x = 0;
-	curs_tmp = 1;
-	while (curs_tmp < col && x < lns[l_y]->l) {
-		if (lns[l_y]->str[x] != '\t')
-			++curs_tmp;
-		else {
-			nx_tab_col = nx_tab(curs_tmp);
-			/*
-			 * Handle the case, when there is a tab-stop-gap
-			 * _below_ our cursor position.  We decide where
-			 * to go: to the begining of a tab stop or to the
-			 * end of it depending on which is closer to us.
-			 */
-			if (nx_tab_col > col) {
-				/* Go to the tab stop start. */
-				if (col-curs_tmp < nx_tab_col-col) {
-					*res_col = curs_tmp;
-					return x;
-				}
-				/* Go to the tab stop end. */
-				else {
-					*res_col = nx_tab_col;
-					return x+1;
-				}
-			}
-			curs_tmp = nx_tab_col;
-		}
-		++x;
+	ly = LN_Y;
+	r = fw_sum(ly) + (wrap ? (char2col(ly, LN_X)-1) / wrap_w : 0);
+	if (r < t || r >= t + ws_row) {
+		ly = fw_find(r < t ? t : t + ws_row-1, &rr);
+		ln_x = col2char(ly, wrap ? rr*wrap_w + 1 : 1, NULL);
 	}
+	off_y = fw_find(t, &off_r);
+	wr_top_ln = off_y;
+	ln_y = ly - off_y;
 	
-	*res_col = curs_tmp;
-	return x;
+	wr_dpl = 1;
+	need_print_pos = 1;
+}
+
+/*
+ * Set current mode and update its name in the head line.
+ */
+void
+set_mod(char m)
+{
+	mod = m;
+	if (mod != MOD_CMD && mod != MOD_SEA)
+		print_mod();
 }
 
 /*
@@ -930,23 +5003,18 @@ col2char(size_t l_y, US col, US* res_col)
 void
 nav_right()
 {
-	/*
-	 * How many column should we move cursor to the
-	 * right.  It is used when we handle tab stops.
-	 */
-	US step;
+	/* The line column of the cursor. */
+	size_t col;
 	
 	if (lns_l == 0)
 		return;
 	
 	/* If it's not the last line character, just move right. */
 	if (LN_X != lns[LN_Y]->l) {
-		if (lns[LN_Y]->str[LN_X] != '\t')
-			step = 1;
-		else
-			step = nx_tab(curs_x) - curs_x;
-		MV_CURS_R(step);
-		ln_x++;
+		col = off_x + curs_x;
+		ln_x = ln_nx(LN_Y, LN_X, &col);
+		curs_x = scrl_to_col(col);
+		SYNC_CURS();
 	}
 	/*
 	 * If this is the last character on the _not_
@@ -960,10 +5028,9 @@ nav_right()
 		 * Scroll is needed only if current line is
 		 * the last visible on the screen.
 		 */
-		scrl = ln_y == ws_row-1;
+		scrl = ln_y == (size_t)ws_row-1;
 		
 		ln_x = 0;
-		curs_x = 1;
 		
 		if (scrl) {
 			off_y++;
@@ -973,6 +5040,7 @@ nav_right()
 			ln_y++;
 			curs_y++;
 		}
+		curs_x = scrl_to_col(1);
 		SYNC_CURS();
 	}
 	/* Don't move cursor otherwise. */
@@ -991,15 +5059,19 @@ nav_left()
 	/* If it is not the first line character, then move left. */
 	if (LN_X != 0) {
 		/* See at `nav_right'. */
-		US step;
-		
-		ln_x--;
+		size_t col;
+		size_t x;
 		
-		if (lns[LN_Y]->str[LN_X] != '\t')
-			step = 1;
+		x = ln_pr(LN_Y, LN_X);
+		/* A plain one column character. */
+		if (x == LN_X-1 && (unsigned char)lns[LN_Y]->str[x] < 0x80 &&
+		    lns[LN_Y]->str[x] != '\t')
+			col = off_x + curs_x - 1;
 		else
-			step = curs_x - char2col(LN_Y, LN_X);
-		MV_CURS_L(step);
+			col = char2col(LN_Y, x);
+		ln_x = x;
+		curs_x = scrl_to_col(col);
+		SYNC_CURS();
 	}
 	/* If the line is not the first in the buffer. */
 	else if (LN_Y != 0) {
@@ -1022,7 +5094,7 @@ nav_left()
 		}
 		
 		ln_x = lns[LN_Y]->l;
-		curs_x = char2col(LN_Y, LN_X);
+		curs_x = scrl_to_col(char2col(LN_Y, LN_X));
 		SYNC_CURS();
 	}
 	/* Don't move the cursor otherwise. */
@@ -1040,13 +5112,13 @@ nav_dwn()
 {
 	/* Is using scroll. */
 	char scrl;
-	US nw_curs_x;
+	size_t nw_col;
 	
 	/* If last line of a _text_. */
 	if (lns_l == 0 || LN_Y == lns_l-1)
 		return;
 	
-	scrl = ln_y == ws_row-1;
+	scrl = ln_y == (size_t)ws_row-1;
 	
 	if (scrl)
 		off_y++;
@@ -1054,11 +5126,11 @@ nav_dwn()
 		ln_y++;
 		curs_y++;
 	}
-	ln_x = col2char(LN_Y, curs_x, &nw_curs_x);
-	curs_x = nw_curs_x;
+	ln_x = col2char(LN_Y, off_x + curs_x, &nw_col);
 		
 	if (scrl)
 		DPL_PG();	
+	curs_x = scrl_to_col(nw_col);
 	SYNC_CURS();
 	
 	need_print_pos = 1;
@@ -1079,7 +5151,7 @@ nav_up()
 	
 	scrl = ln_y == 0;
 	
-	US nw_curs_x;
+	size_t nw_col;
 	
 	if (scrl)
 		off_y--;
@@ -1087,11 +5159,11 @@ nav_up()
 		curs_y--;
 		ln_y--;
 	}
-	ln_x = col2char(LN_Y, curs_x, &nw_curs_x);
-	curs_x = nw_curs_x;
+	ln_x = col2char(LN_Y, off_x + curs_x, &nw_col);
 	
 	if (scrl)
 		DPL_PG();
+	curs_x = scrl_to_col(nw_col);
 	SYNC_CURS();
 	
 	need_print_pos = 1;
@@ -1133,6 +5205,7 @@ scrl_dwn(size_t scrl_ln)
 	if (scrl_n > ln_y || curs_y-scrl_n < BUF_ROW) {
 		curs_x = 1;
 		curs_y = BUF_ROW;
+		off_x = 0;
 		ln_x = 0;
 		ln_y = 0;
 	}
@@ -1186,6 +5259,7 @@ scrl_up(size_t scrl_ln)
 	if (curs_y+scrl_n > ws_row-1) {
 		curs_x = 1;
 		curs_y = ws_row;
+		off_x = 0;
 		ln_x = 0;
 		ln_y = ws_row-1;
 	}
@@ -1213,9 +5287,8 @@ scrl_up(size_t scrl_ln)
 void
 scrl_end()
 {
-	US last_row;
+	size_t last_row;
 	
-	curs_x = char2col(lns_l-1, lns[lns_l-1]->l);
 	ln_x = lns[lns_l-1]->l;
 	last_row = lns_l - off_y;
 	
@@ -1237,8 +5310,12 @@ scrl_end()
 	else {
 		ln_y = last_row-1;
 		curs_y = last_row;
-		SYNC_CURS();
 	}
+	/* With hidden lines it's the last screen of rows, not of lines. */
+	if (HID_ANY)
+		wr_bot = 1;
+	curs_x = scrl_to_col(char2col(LN_Y, LN_X));
+	SYNC_CURS();
 	
 	need_print_pos = 1;
 }
@@ -1260,8 +5337,9 @@ scrl_start()
 	curs_y = 1;
 	
 	/* If we need to do actual scroll and redraw page. */
-	if (off_y != 0) {
+	if (off_y != 0 || off_x != 0) {
 		off_y = 0;
+		off_x = 0;
 		DPL_PG();
 	}
 	/*
@@ -1284,9 +5362,8 @@ nav_ln_start()
 	if (LN_X == 0)
 		return;
 	
-	off_x = 0;
 	ln_x = 0;
-	curs_x = 1;
+	curs_x = scrl_to_col(1);
 	SYNC_CURS();
 	
 	need_print_pos = 1;
@@ -1303,7 +5380,7 @@ nav_ln_end()
 		return;
 	
 	ln_x = lns[LN_Y]->l;
-	curs_x = char2col(LN_Y, lns[LN_Y]->l);
+	curs_x = scrl_to_col(char2col(LN_Y, lns[LN_Y]->l));
 	SYNC_CURS();
 	
 	need_print_pos = 1;
@@ -1319,7 +5396,7 @@ nav_word_nx()
 {
 	size_t i;
 	size_t nav_char;
-	US nav_col;
+	size_t nav_col;
 	char first;
 	
 	nav_char = 0;
@@ -1363,66 +5440,501 @@ nav_word_nx()
 out:
 	nav_col = char2col(LN_Y, nav_char);
 	ln_x = nav_char;
-	curs_x = nav_col;
+	curs_x = scrl_to_col(nav_col);
+	SYNC_CURS();
+	
+	need_print_pos = 1;
+}
+
+/*
+ * Navigate to the previous word-boundary.
+ * See the definition of ``word'' in `nav_word_nx'.
+ */
+void
+nav_word_pr()
+{
+	size_t i;
+	size_t nav_char;
+	size_t nav_col;
+	char first;
+	
+	nav_char = 0;
+	first = 1;
+	
+	/* If we're at the first line character. */
+	if (LN_X == 0) {
+		/* If we're in the first text line - skip. */
+		if (LN_Y == 0)
+			return;
+		/* Otherwise, it's the same as navigate to the left. */
+		nav_left();
+		return;
+	}
+	
+	for (i = LN_X-1; i >= 0; (--i, first = 0)) {
+		if (i == 0) {
+			nav_char = 0;
+			break;
+		}
+		switch (lns[LN_Y]->str[i]) {
+		CASE_SEPARATOR:
+			/*
+			 * Implement navigating to the word boundaries.
+			 */
+			if (!first)
+				nav_char = i+1;
+			else {
+				/* Jump through the repeated separators. */
+				while (i != 0 &&
+				    lns[LN_Y]->str[i-1] == lns[LN_Y]->str[i])
+					--i;
+				nav_char = i;
+			}
+			goto out;
+		}
+	}
+out:
+	nav_col = char2col(LN_Y, nav_char);
+	ln_x = nav_char;
+	curs_x = scrl_to_col(nav_col);
 	SYNC_CURS();
 	
 	need_print_pos = 1;
 }
 
 /*
- * Navigate to the previous word-boundary.
- * See the definition of ``word'' in `nav_word_nx'.
+ * Save the viewport of the view being worked in (see `struct vw').
+ */
+void
+vw_st()
+{
+	struct vw* v;
+	
+	v = &vws[vw_cur];
+	v->off_y = off_y;
+	v->off_x = off_x;
+	v->ln_x = ln_x;
+	v->ln_y = ln_y;
+	v->curs_y = curs_y;
+	v->curs_x = curs_x;
+	v->nav_curs_y = nav_curs_y;
+	v->nav_curs_x = nav_curs_x;
+	v->off_r = off_r;
+	v->wr_top_ln = wr_top_ln;
+}
+
+/*
+ * Make the view `i' the one being worked in: its part of the screen
+ * and its viewport become the current ones.  The viewport of the one
+ * that was worked in is expected to be saved by `vw_st'.
+ */
+void
+vw_ld(int i)
+{
+	struct vw* v;
+	
+	vw_cur = i;
+	v = &vws[i];
+	vw_y0 = v->y0;
+	vw_x0 = v->x0;
+	ws_row = v->rows-1;
+	ws_col = v->cols;
+	off_y = v->off_y;
+	off_x = v->off_x;
+	ln_x = v->ln_x;
+	ln_y = v->ln_y;
+	curs_y = v->curs_y;
+	curs_x = v->curs_x;
+	nav_curs_y = v->nav_curs_y;
+	nav_curs_x = v->nav_curs_x;
+	off_r = v->off_r;
+	wr_top_ln = v->wr_top_ln;
+}
+
+/*
+ * Make the viewport of the view being worked in fit the text and the
+ * view: the lines may have gone from under it, and the view may have
+ * shrunk, since it was worked in.  The text is not redrawn.
+ */
+void
+vw_fit()
+{
+	US* cy;
+	US* cx;
+	
+	/* In the ``CMD'' mode it's where the cursor goes back to. */
+	cy = &curs_y;
+	cx = &curs_x;
+	if (mod == MOD_CMD || mod == MOD_SEA) {
+		cy = &nav_curs_y;
+		cx = &nav_curs_x;
+	}
+	
+	if (lns_l != 0 && off_y >= lns_l)
+		off_y = lns_l-1;
+	if (lns_l != 0 && LN_Y >= lns_l)
+		ln_y = lns_l-1 - off_y;
+	/* With the soft wrap or folds it's up to `wr_fix'. */
+	if (ln_y >= ws_row && !WR_MAP) {
+		off_y += ln_y - ws_row+1;
+		ln_y = ws_row-1;
+	}
+	*cy = ln_y+1;
+	if (lns_l == 0)
+		return;
+	
+	ln_x = CLAMP_MAX(ln_x, lns[LN_Y]->l);
+	while (ln_x > 0 && IS_U8_CONT(lns[LN_Y]->str[ln_x]))
+		ln_x--;
+	*cx = scrl_to_col(char2col(LN_Y, LN_X));
+	wr_fix();
+}
+
+/*
+ * Draw the column `VW_SEP' between the views side by side.
+ */
+void
+vw_sep()
+{
+	int i;
+	US r;
+	
+	for (i = 0; i < vws_l; ++i) {
+		if (vws[i].x0 == 0)
+			continue;
+		for (r = vws[i].y0; r < vws[i].y0 + vws[i].rows; ++r)
+			scr_nw[(size_t)r*scr_cols + vws[i].x0-1] =
+			    MK_CELL(VW_SEP, 0);
+	}
+}
+
+/*
+ * Draw the view `i', which is not the one being worked in, or only
+ * its status line if `sts' is set.
+ */
+void
+vw_dpl(int i, char sts)
+{
+	int cur;
+	
+	cur = vw_cur;
+	vw_st();
+	vw_ld(i);
+	vw_oth = 1;
+	if (sts)
+		print_status();
+	else
+		DPL_PG();
+	vw_oth = 0;
+	vw_ld(cur);
+	SYNC_CURS();
+}
+
+/*
+ * Redraw the status lines of the views that are not worked in (the
+ * ``CMD'' line is drawn over the bottom ones).
+ */
+void
+vw_sts()
+{
+	int i;
+	
+	for (i = 0; i < vws_l; ++i) {
+		if (i != vw_cur)
+			vw_dpl(i, 1);
+	}
+}
+
+/*
+ * Redraw all the views.
+ */
+void
+vw_dpl_all()
+{
+	int i;
+	
+	for (i = 0; i < vws_l; ++i) {
+		if (i != vw_cur)
+			vw_dpl(i, 0);
+	}
+	vw_sep();
+	DPL_PG();
+}
+
+/*
+ * Bring the views that are not worked in up to date after the text
+ * has been edited: only the ones that show the changed lines are
+ * redrawn.  With syntax highlighting, the lines below the changed ones
+ * may have changed their colors too.
+ */
+void
+vw_upd()
+{
+	int i;
+	size_t hi;
+	
+	hi = hl_lang != NULL && hl_on ? (size_t)-1 : vw_hi;
+	for (i = 0; vw_lo != (size_t)-1 && i < vws_l; ++i) {
+		/* With hidden lines a view shows lines further down. */
+		if (i != vw_cur && vws[i].off_y <= hi && (HID_ANY ||
+		    vws[i].off_y + vws[i].rows-1 > vw_lo))
+			vw_dpl(i, 0);
+	}
+	vw_lo = (size_t)-1;
+	vw_hi = 0;
+}
+
+/*
+ * Let the views know that the line `i' has been inserted (`d' is `1')
+ * or removed (`d' is `-1'): the ones that are not worked in keep
+ * showing the same lines, and all of them below `i' are to be
+ * redrawn.
+ */
+void
+vw_mv(size_t i, int d)
+{
+	struct vw* v;
+	int j;
+	/* The line of the cursor of the view. */
+	size_t c;
+	
+	for (j = 0; j < vws_l; ++j) {
+		v = &vws[j];
+		if (j == vw_cur)
+			continue;
+		c = v->off_y + v->ln_y;
+		if (d > 0 ? c >= i : c > i)
+			c += d;
+		if (d > 0 ? v->off_y >= i : v->off_y > i)
+			v->off_y += d;
+		if (c < v->off_y)
+			v->off_y = c;
+		if (c - v->off_y >= (size_t)v->rows-1)
+			v->off_y = c - (v->rows-2);
+		v->ln_y = c - v->off_y;
+	}
+	if (vw_lo > i)
+		vw_lo = i;
+	vw_hi = (size_t)-1;
+}
+
+/*
+ * Set the width the rows are wrapped at: it's the same for all the
+ * views, so the number of rows of the lines is (see `wr_fw').
+ */
+void
+vw_wrap_w()
+{
+	int i;
+	US w;
+	
+	w = vws[0].cols;
+	for (i = 1; i < vws_l; ++i)
+		w = CLAMP_MAX(w, vws[i].cols);
+	wrap_w = w < TABSIZE ? w : w - w % TABSIZE;
+}
+
+/*
+ * Set up the views after their parts of the screen have changed:
+ * every viewport is fit in its view, and all of them are redrawn.
+ */
+void
+vw_lay()
+{
+	int i;
+	int cur;
+	
+	vw_wrap_w();
+	if (WR_MAP) {
+		WR_MV(0);
+		wr_upd();
+		wr_dpl = 1;
+	}
+	cur = vw_cur;
+	vw_st();
+	for (i = 0; i < vws_l; ++i) {
+		vw_ld(i);
+		vw_fit();
+		vw_st();
+	}
+	vw_ld(cur);
+	vw_dpl_all();
+}
+
+/*
+ * Scale the parts of the screen of the views to its new size, it was
+ * `rows' by `cols' before.  If some view gets too small, only the one
+ * being worked in is left.
+ * --
+ * Every edge is scaled the same way, so the views that share one keep
+ * sharing it.
+ */
+void
+vw_rsz(US rows, US cols)
+{
+	struct vw* v;
+	int i;
+	/* The right edge of the view, with the column after it. */
+	US xe;
+	US ye;
+	
+	vw_st();
+	for (i = 0; vws_l > 1 && i < vws_l; ++i) {
+		v = &vws[i];
+		xe = v->x0 + v->cols == cols ? scr_cols :
+		    (v->x0 + v->cols+1) * scr_cols / cols - 1;
+		ye = (v->y0 + v->rows) * scr_rows / rows;
+		v->x0 = v->x0 * scr_cols / cols;
+		v->y0 = v->y0 * scr_rows / rows;
+		v->cols = xe > v->x0 ? xe - v->x0 : 0;
+		v->rows = ye > v->y0 ? ye - v->y0 : 0;
+		if (v->cols < 1 || v->rows < 2)
+			break;
+	}
+	if (vws_l == 1 || i < vws_l) {
+		vws[0] = vws[vw_cur];
+		vws_l = 1;
+		vw_cur = 0;
+		vws[0].y0 = vws[0].x0 = 0;
+		vws[0].rows = scr_rows;
+		vws[0].cols = scr_cols;
+	}
+	vw_ld(vw_cur);
+	vw_wrap_w();
+}
+
+/*
+ * Switch to the next view.
+ */
+void
+vw_nx()
+{
+	if (vws_l == 1)
+		return;
+	vw_st();
+	vw_ld((vw_cur+1) % vws_l);
+	vw_fit();
+	vw_dpl_all();
+}
+
+/*
+ * Hide the line `i' that is folded (if `hid' is set), or show it
+ * again.  Its rows are taken out of the tree `wr_fw' (or put back),
+ * unless the tree is to be built anew anyway.
+ */
+void
+fd_hide(size_t i, char hid)
+{
+	size_t rows;
+	
+	if (lns[i]->fd_hid == hid)
+		return;
+	rows = WR_LN(i);
+	lns[i]->fd_hid = hid;
+	if (i < wr_mv && i < wr_fw_l)
+		fw_add(i, WR_LN(i) - rows);
+}
+
+/*
+ * The folds (or the filter) have changed, so all the views are
+ * redrawn.  Once no line is hidden (and there's no soft wrap), every
+ * line takes one row again and the viewport is fit in the screen
+ * that way.
+ */
+void
+fd_chg()
+{
+	vw_lo = 0;
+	vw_hi = (size_t)-1;
+	if (WR_MAP) {
+		wr_dpl = 1;
+		return;
+	}
+	vw_fit();
+	DPL_PG();
+}
+
+/*
+ * Open the fold under the line `h': its lines are shown again.
+ */
+void
+fd_open(size_t h)
+{
+	size_t i;
+	
+	for (i = h+1; i <= h + lns[h]->fd_n; ++i)
+		fd_hide(i, 0);
+	lns[h]->fd_n = 0;
+	fd_l--;
+	fd_chg();
+}
+
+/*
+ * Make sure the line `i' is shown: open the fold it's in, if any, and
+ * let it through the filter.
  */
 void
-nav_word_pr()
+fd_reveal(size_t i)
 {
-	size_t i;
-	size_t nav_char;
-	US nav_col;
-	char first;
-	
-	nav_char = 0;
-	first = 1;
-	
-	/* If we're at the first line character. */
-	if (LN_X == 0) {
-		/* If we're in the first text line - skip. */
-		if (LN_Y == 0)
-			return;
-		/* Otherwise, it's the same as navigate to the left. */
-		nav_left();
+	if (i >= lns_l)
 		return;
-	}
+	fl_show(i);
+	if (!lns[i]->fd_hid)
+		return;
+	while (lns[i]->fd_hid)
+		i--;
+	fd_open(i);
+}
+
+/*
+ * Fold the lines (`h', `e'] under the line `h', i.e. hide them and
+ * show a mark after `h' (see `dpl_wr_pg').  The folds are not nested:
+ * the ones that are in the way are merged into this one.
+ * --
+ * The lines are mapped to the rows through the tree `wr_fw' (see
+ * `wr_fix'), where the hidden ones take no rows.  So a cursor in the
+ * fold goes to `h', and a screen row is found in O(log n) no matter
+ * how many lines are folded.
+ */
+void
+fd_mk(size_t h, size_t e)
+{
+	size_t i;
 	
-	for (i = LN_X-1; i >= 0; (--i, first = 0)) {
-		if (i == 0) {
-			nav_char = 0;
-			break;
-		}
-		switch (lns[LN_Y]->str[i]) {
-		CASE_SEPARATOR:
-			/*
-			 * Implement navigating to the word boundaries.
-			 */
-			if (!first)
-				nav_char = i+1;
-			else {
-				/* Jump through the repeated separators. */
-				while (i != 0 &&
-				    lns[LN_Y]->str[i-1] == lns[LN_Y]->str[i])
-					--i;
-				nav_char = i;
-			}
-			goto out;
-		}
+	while (lns[h]->fd_hid)
+		h--;
+	/* The tree has not been kept up to date without the folds. */
+	if (!WR_MAP)
+		WR_MV(0);
+	for (i = h; i <= e; ++i) {
+		if (lns[i]->fd_n == 0)
+			continue;
+		if (e < i + lns[i]->fd_n)
+			e = i + lns[i]->fd_n;
+		lns[i]->fd_n = 0;
+		fd_l--;
 	}
-out:
-	nav_col = char2col(LN_Y, nav_char);
-	ln_x = nav_char;
-	curs_x = nav_col;
-	SYNC_CURS();
-	
-	need_print_pos = 1;
+	for (i = h+1; i <= e; ++i)
+		fd_hide(i, 1);
+	lns[h]->fd_n = e - h;
+	fd_l++;
+	/* See `wr_ln'. */
+	wr_ln = (size_t)-1;
+	fd_chg();
+}
+
+/*
+ * Turn the filter off (if `l' is `0') or on, with the pattern `fl_pat'
+ * `l' bytes long that `fl_scan' has been run with.  The cursor goes
+ * to the next line that is shown.
+ */
+void
+fl_set(size_t l)
+{
+	fl_l = l;
+	WR_MV(0);
+	wr_ln = LN_Y;
+	fd_chg();
 }
 
 /*
@@ -1441,9 +5953,13 @@ del_ln_fwd()
 	 */
 	if (lns[LN_Y]->l != 0 || lns_l == 1) {
 		lns[LN_Y]->l = LN_X;
+		TOUCH_LN(LN_Y, LN_X);
 		ERS_LINE_FWD();
 		return;
 	}
+	/* The lines folded under it would be under the one above. */
+	if (lns[LN_Y]->fd_n != 0)
+		fd_open(LN_Y);
 	
 	/*
 	 * If we've reached this, it means we're in the
@@ -1469,13 +5985,16 @@ del_ln_fwd()
 	/* Move all lines that are after the deleted one up. */
 	memcpy(&lns[LN_Y], &lns[LN_Y+1],
 		(lns_sz-LN_Y-1) * (sizeof(struct ln*)));
+	HL_FROM(LN_Y);
+	WR_MV(LN_Y);
+	vw_mv(LN_Y, -1);
 	
 	lns_l--;
 	lns_sz--;
 	
 	if (last) {
 		/* Case #1 (subcase 2). */
-		if (ln_y == ws_row - 1 && off_y != 0) {
+		if (ln_y == (size_t)ws_row - 1 && off_y != 0) {
 			/*
 			 * Move screen one line up to not render empty
 			 * line markers.
@@ -1506,7 +6025,7 @@ del_ln_fwd()
 			 * we really need is to move cursor one line
 			 * up and put an empty line marker below.
 			 */
-			dprintf(STDOUT_FILENO, EMPT_LN_MARK);
+			scr_str(EMPT_LN_MARK);
 			
 			/* Move cursor one line up. */
 			ln_y--;
@@ -1563,11 +6082,11 @@ esc_cmd(char sea)
  * Clean up search highlighting from screen.
  */
 void
-clean_sea(char is_new_sea)
+clean_sea()
 {
+	in_sea = 0;
 	MV_CURS_SF(curs_y_tmp, curs_x_tmp);
-	write(STDIN_FILENO, lns[mat_i]->str+mat_off,
-	    (is_new_sea ? prev_fnd_i : fnd_i));
+	vw_dpl_all();
 	RST_CURS();
 	ln_x = ln_x_tmp;
 	ln_y = ln_y_tmp;
@@ -1583,13 +6102,12 @@ void
 quit_cmd()
 {
 	CLN_CMD();
-	if (in_sea == 1) {
-		clean_sea(0);
-		in_sea = 0;
-	}
+	if (in_sea == 1)
+		clean_sea();
 	mod = MOD_NAV;
 	MV_CURS(nav_curs_y, nav_curs_x);
 	print_status();
+	vw_sts();
 }
 
 /*
@@ -1606,9 +6124,12 @@ dpl_cmd_txt(char* msg)
 	 */
 	cmd_txt = srealloc(cmd_txt, strlen(msg)+1);
 	strcpy(cmd_txt, msg);
+	/* The rest of the macro would go to the message. */
+	if (mc_on)
+		mc_stop();
 	
 	CLN_CMD();
-	WR_REV_VID("%s", msg);
+	WR_REV_VID(msg, strlen(msg));
 	
 	/*
 	 * For cursor not to hang about in the end.
@@ -1640,6 +6161,11 @@ read_cmd()
 	 * first character that will appear in `cmd'.
 	 */
 	int first;
+	/* The key that sends a sequence and what is pasted. */
+	int k;
+	char* s;
+	size_t n;
+	size_t i;
 	
 	cmd_i = 0;
 	first = 1;
@@ -1649,7 +6175,29 @@ read_cmd()
 	 * `\n' indicates the end of a command.
 	 */
 	for (;;) {
-		if (read(STDIN_FILENO, &buf, 1) > 0) {
+		if (rd_in(buf) > 0) {
+			/*
+			 * A paste goes in as if it was typed, up to its
+			 * first line break (which doesn't run the command).
+			 * The other keys that send sequences mean nothing
+			 * in here.
+			 */
+			if (*buf == ESC && (k = in_key()) != KEY_ESC) {
+				if (k != KEY_PST)
+					continue;
+				s = rd_pst(&n);
+				for (i = 0; i < n && cmd_i < IOBUF-1; ++i) {
+					if (s[i] == '\r' || s[i] == '\n')
+						break;
+					if (IS_PRINTABLE(s[i])) {
+						first = 0;
+						cmd[cmd_i++] = s[i];
+						scr_wr(&s[i], 1);
+					}
+				}
+				free(s);
+				continue;
+			}
 			switch (*buf) {
 			/*
 			 * If we meet `ESC' or `Backspace' or `DEL' in the
@@ -1715,79 +6263,566 @@ read_cmd()
 					 */
 					first = 0;
 					cmd[cmd_i++] = *buf;
-					write(STDOUT_FILENO, &buf, 1);
+					scr_wr(buf, 1);
 				}
 			}
 		}
 	}
 	
-	/*
-	 * Actually we can reach this place only if we've entered
-	 * `IOBUF' characters and _didn't_ put a `\n' there.  So
-	 * it means that input is invalid.
-	 */
-	return 1;
+	/*
+	 * Actually we can reach this place only if we've entered
+	 * `IOBUF' characters and _didn't_ put a `\n' there.  So
+	 * it means that input is invalid.
+	 */
+	return 1;
+}
+
+/*
+ * ``CMD'' `f' without arguments prints the current filepath,
+ * to which the buffer will be saved in case of writing (`w') it.
+ * If it's invoked with argument like: `f <path>', then it sets
+ * current filepath to `path'.
+ * --
+ * Return format the same as for `do_cmd'.
+ */
+int
+do_filepath()
+{
+	char* cmdp;
+	
+	cmdp = &cmd[1];
+	
+	switch (*cmdp) {
+	case '\n':
+		if (filepath == NULL)
+			dpl_cmd_txt("<Anonymous>");
+		else if (dirty) {
+			/*
+			 * If the text buffer is dirty, prepend the
+			 * filename with a marker.
+			 */
+			char* dirty_filepath;
+			
+			dirty_filepath = smalloc(strlen(filepath)+2);
+			strcpy(dirty_filepath, DIRTY_MARK);
+			strcat(dirty_filepath, filepath);
+			
+			dpl_cmd_txt(dirty_filepath);
+			free(dirty_filepath);
+		}
+		else
+			dpl_cmd_txt(filepath);
+		return 1;
+	case ' ': {
+		char* path;
+		int i;
+		
+		cmdp++;
+		path = smalloc(PATH_MAX+1);
+		
+		for (i = 0; i < PATH_MAX; ++i) {
+			if (*(cmdp+i) == '\n')
+				break;
+			path[i] = *(cmdp+i);
+		}
+		if (i == 0)
+			return -1;
+		path[i+1] = '\0';
+		
+		SET_FILEPATH(path);
+		free(path);
+		hl_detect();
+		DPL_PG();
+		return 0;
+	}
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Turn the syntax highlighting on and off.
+ * Format of a return value the same as for `do_cmd'.
+ */
+int
+do_hl()
+{
+	if (cmd[1] != '\n')
+		return -1;
+	if (hl_lang == NULL) {
+		dpl_cmd_txt("No highlighting for this file.");
+		return 1;
+	}
+	
+	hl_on = !hl_on;
+	DPL_PG();
+	return 0;
+}
+
+/*
+ * Is the view `o' next to the side `side' of the view `v' (`0' to `3'
+ * for the top, bottom, left and right one), and not longer than that
+ * side.  How much of the side it takes is put in `len'.
+ */
+char
+vw_nx_to(struct vw* o, struct vw* v, int side, size_t* len)
+{
+	if (side < 2) {
+		*len = o->cols+1;
+		return (side == 0 ? o->y0 + o->rows == v->y0 :
+		    o->y0 == v->y0 + v->rows) && o->x0 >= v->x0 &&
+		    o->x0 + o->cols <= v->x0 + v->cols;
+	}
+	*len = o->rows;
+	return (side == 2 ? o->x0 + o->cols+1 == v->x0 :
+	    o->x0 == v->x0 + v->cols+1) && o->y0 >= v->y0 &&
+	    o->y0 + o->rows <= v->y0 + v->rows;
+}
+
+/*
+ * Split the view being worked in into two: one above the other, or
+ * side by side for ``v''.  Both show what it did, and the top (or
+ * left) one is still worked in.
+ * Format of a return value the same as for `do_cmd'.
+ */
+int
+do_split()
+{
+	struct vw* v;
+	struct vw* n;
+	char side;
+	
+	if (cmd[1] != '\n')
+		return -1;
+	
+	side = cmd[0] == 'v';
+	v = &vws[vw_cur];
+	if (vws_l == VW_MAX || (side ? v->cols < VW_MIN_COLS :
+	    v->rows < VW_MIN_ROWS)) {
+		dpl_cmd_txt("Can't - no room for one more view.");
+		return 1;
+	}
+	
+	vw_st();
+	n = &vws[vws_l++];
+	*n = *v;
+	if (side) {
+		v->cols = (v->cols-1) / 2;
+		n->x0 += v->cols+1;
+		n->cols -= v->cols+1;
+	}
+	else {
+		v->rows /= 2;
+		n->y0 += v->rows;
+		n->rows -= v->rows;
+	}
+	vw_ld(vw_cur);
+	vw_lay();
+	return 0;
+}
+
+/*
+ * Close the view being worked in.  The views next to one of its sides
+ * take its part of the screen, and the first of them is worked in.
+ * Format of a return value the same as for `do_cmd'.
+ */
+int
+do_close()
+{
+	struct vw* v;
+	struct vw* o;
+	int i;
+	int side;
+	int nx;
+	size_t len;
+	size_t sum;
+	
+	if (cmd[1] != '\n')
+		return -1;
+	if (vws_l == 1) {
+		dpl_cmd_txt("Can't - it's the only view.");
+		return 1;
+	}
+	
+	/*
+	 * The views are split in halves, so there always is a side
+	 * the views next to which fill up exactly.
+	 */
+	v = &vws[vw_cur];
+	for (side = 0; side < 4; ++side) {
+		sum = 0;
+		for (i = 0; i < vws_l; ++i) {
+			if (i != vw_cur && vw_nx_to(&vws[i], v, side, &len))
+				sum += len;
+		}
+		if (sum == (side < 2 ? (size_t)v->cols+1 : v->rows))
+			break;
+	}
+	if (side == 4)
+		return -1;
+	
+	nx = -1;
+	for (i = 0; i < vws_l; ++i) {
+		o = &vws[i];
+		if (i == vw_cur || !vw_nx_to(o, v, side, &len))
+			continue;
+		if (nx == -1)
+			nx = i;
+		if (side < 2) {
+			o->y0 = side == 0 ? o->y0 : v->y0;
+			o->rows += v->rows;
+		}
+		else {
+			o->x0 = side == 2 ? o->x0 : v->x0;
+			o->cols += v->cols+1;
+		}
+	}
+	
+	memmove(v, v+1, (vws_l - vw_cur-1) * sizeof(struct vw));
+	vws_l--;
+	vw_ld(nx > vw_cur ? nx-1 : nx);
+	vw_lay();
+	return 0;
+}
+
+/*
+ * Turn the soft wrap of long lines on and off.
+ * Format of a return value the same as for `do_cmd'.
+ */
+int
+do_wrap()
+{
+	if (cmd[1] != '\n')
+		return -1;
+	
+	wrap = !wrap;
+	off_x = 0;
+	off_r = 0;
+	wr_top_ln = off_y;
+	/* The lines take other numbers of rows now. */
+	WR_MV(0);
+	if (WR_MAP)
+		wr_dpl = 1;
+	else {
+		nav_curs_y = ln_y+1;
+		if (lns_l != 0)
+			nav_curs_x = scrl_to_col(char2col(LN_Y, LN_X));
+		DPL_PG();
+	}
+	return 0;
+}
+
+/*
+ * Get the column the text of the line `i' starts at (after its
+ * indentation), or `0' if the line is blank.
+ */
+size_t
+fd_ind(size_t i)
+{
+	size_t x;
+	
+	for (x = 0; x < lns[i]->l &&
+	    (lns[i]->str[x] == ' ' || lns[i]->str[x] == '\t'); ++x)
+		;
+	return x == lns[i]->l ? 0 : char2col(i, x);
+}
+
+/*
+ * Get the last line of the fold that the line `h' starts: the one
+ * with the `FD_END' that matches the `FD_BEG' of `h' if it has one,
+ * or the last of the lines below that are indented deeper otherwise
+ * (the blank ones are taken only between such lines).  It's `h' if
+ * there is nothing to fold.
+ */
+size_t
+fd_end(size_t h)
+{
+	size_t i;
+	size_t e;
+	size_t ind;
+	size_t lvl;
+	
+	if (str_n_str(lns[h]->str, FD_BEG, lns[h]->l, 0) != NULL) {
+		for (i = h, lvl = 0; i < lns_l; ++i) {
+			if (str_n_str(lns[i]->str, FD_BEG, lns[i]->l, 0) !=
+			    NULL)
+				lvl++;
+			if (str_n_str(lns[i]->str, FD_END, lns[i]->l, 0) !=
+			    NULL && --lvl == 0)
+				return i;
+		}
+		return h;
+	}
+	
+	ind = fd_ind(h);
+	for (i = h+1, e = h; i < lns_l; ++i) {
+		if (fd_ind(i) == 0)
+			continue;
+		if (fd_ind(i) <= ind)
+			break;
+		e = i;
+	}
+	return e;
+}
+
+/*
+ * Fold the lines that belong to the current one (see `fd_end'), or
+ * open the fold under it.  ``Z'' opens all the folds.
+ * Format of a return value the same as for `do_cmd'.
+ */
+int
+do_fold()
+{
+	size_t i;
+	size_t e;
+	
+	if (cmd[1] != '\n')
+		return -1;
+	
+	if (cmd[0] == 'Z') {
+		for (i = 0; fd_l != 0 && i < lns_l; ++i) {
+			if (lns[i]->fd_n != 0)
+				fd_open(i);
+		}
+		return 0;
+	}
+	if (lns_l != 0 && lns[LN_Y]->fd_n != 0) {
+		fd_open(LN_Y);
+		return 0;
+	}
+	if (lns_l == 0 || (e = fd_end(LN_Y)) == LN_Y) {
+		dpl_cmd_txt("Can't - nothing to fold.");
+		return 1;
+	}
+	fd_mk(LN_Y, e);
+	return 0;
+}
+
+/*
+ * Thread routine running the filter over its share of lines.
+ * See `fl_job'.
+ */
+void*
+fl_thr(void* arg)
+{
+	struct fl_job* job;
+	size_t i;
+	
+	job = arg;
+	for (i = job->from; i < job->to; ++i) {
+		fl_res[i] = str_n_str(lns[i]->str, fl_new, lns[i]->l,
+		    0) == NULL;
+		if (!fl_res[i])
+			job->n++;
+	}
+	return NULL;
 }
 
 /*
- * ``CMD'' `f' without arguments prints the current filepath,
- * to which the buffer will be saved in case of writing (`w') it.
- * If it's invoked with argument like: `f <path>', then it sets
- * current filepath to `path'.
- * --
- * Return format the same as for `do_cmd'.
+ * Set the filter that has been looked for (see `fl_scan'), or tell
+ * that no line has it.  `arg' is not `NULL' if it has been done by the
+ * thread `fl_tid'.
  */
-int
-do_filepath()
+void
+fl_done(void* arg)
 {
-	char* cmdp;
+	size_t i;
 	
-	cmdp = &cmd[1];
+	if (arg != NULL)
+		pthread_join(fl_tid, NULL);
+	fl_busy = 0;
+	if (fl_n == 0) {
+		fl_set(0);
+		dpl_cmd_txt("Can't - no line has it.");
+		return;
+	}
+	memcpy(fl_pat, fl_new, fl_new_l+1);
+	++fl_gen;
+	for (i = 0; i < lns_l; ++i) {
+		lns[i]->fl_out = fl_res[i];
+		lns[i]->fl_gen = fl_gen;
+	}
+	fl_set(fl_new_l);
+	wr_fix();
+	quit_cmd();
+	vw_upd();
+}
+
+/*
+ * Thread routine running the new filter `fl_new' over all the lines
+ * and, unless `arg' is `NULL', handing the result to the main thread
+ * (see `fl_done').  Big buffers are split among more threads in runs
+ * of lines.
+ */
+void*
+fl_run(void* arg)
+{
+	struct fl_job jobs[FL_THR_MAX];
+	pthread_t thrs[FL_THR_MAX];
+	long thr_n;
+	long t;
+	size_t n;
+	
+	thr_n = 1;
+	if (lns_l >= FL_PAR_MIN)
+		thr_n = CLAMP_MAX(sysconf(_SC_NPROCESSORS_ONLN), FL_THR_MAX);
+	if (thr_n < 1)
+		thr_n = 1;
+	for (t = 0; t < thr_n; ++t) {
+		jobs[t].from = lns_l / thr_n * t;
+		jobs[t].to = t == thr_n-1 ? lns_l : lns_l / thr_n * (t+1);
+		jobs[t].n = 0;
+		jobs[t].thr = 0;
+	}
 	
-	switch (*cmdp) {
-	case '\n':
-		if (filepath == NULL)
-			dpl_cmd_txt("<Anonymous>");
-		else if (dirty) {
-			/*
-			 * If the text buffer is dirty, prepend the
-			 * filename with a marker.
-			 */
-			char* dirty_filepath;
-			
-			dirty_filepath = smalloc(strlen(filepath)+2);
-			strcpy(dirty_filepath, DIRTY_MARK);
-			strcat(dirty_filepath, filepath);
-			
-			dpl_cmd_txt(dirty_filepath);
-			free(dirty_filepath);
-		}
+	/* See `wr_lns_par'. */
+	for (t = 1; t < thr_n; ++t) {
+		if (pthread_create(&thrs[t], NULL, fl_thr, &jobs[t]) == 0)
+			jobs[t].thr = 1;
 		else
-			dpl_cmd_txt(filepath);
+			fl_thr(&jobs[t]);
+	}
+	fl_thr(&jobs[0]);
+	
+	n = jobs[0].n;
+	for (t = 1; t < thr_n; ++t) {
+		if (jobs[t].thr)
+			pthread_join(thrs[t], NULL);
+		n += jobs[t].n;
+	}
+	fl_n = n;
+	if (arg != NULL)
+		ev_post(fl_done, arg);
+	return NULL;
+}
+
+/*
+ * Start looking for the new filter `fl_new' in the lines, so that
+ * none of them has to be looked at when the text is drawn.  The user
+ * doesn't wait for it, unless there are no more threads: then it's
+ * done right away.
+ * Returns whether it goes on in the background.
+ */
+char
+fl_scan()
+{
+	if (lns_l > fl_res_sz) {
+		fl_res_sz = lns_l;
+		fl_res = srealloc(fl_res, fl_res_sz);
+	}
+	fl_busy = 1;
+	if (pthread_create(&fl_tid, NULL, fl_run, &fl_busy) == 0)
 		return 1;
-	case ' ': {
-		char* path;
-		int i;
-		
-		cmdp++;
-		path = smalloc(PATH_MAX+1);
-		
-		for (i = 0; i < PATH_MAX; ++i) {
-			if (*(cmdp+i) == '\n')
-				break;
-			path[i] = *(cmdp+i);
-		}
-		if (i == 0)
+	fl_run(NULL);
+	fl_done(NULL);
+	return 0;
+}
+
+/*
+ * Show only the lines that have the pattern after ``&'' in them, or
+ * all of them again if there is none.  The lines that are edited are
+ * looked at again (see `fl_ln').
+ * Format of a return value the same as for `do_cmd'.
+ */
+int
+do_filter()
+{
+	size_t l;
+	
+	l = strchr(cmd, '\n') - &cmd[1];
+	if (l == 0) {
+		fl_set(0);
+		return 0;
+	}
+	memcpy(fl_new, &cmd[1], l);
+	fl_new[l] = '\0';
+	fl_new_l = l;
+	if (!fl_scan())
+		return 1;
+	/* The keys that are there already would wait for it anyway. */
+	if (in_pend())
+		fl_wait();
+	else
+		dpl_cmd_txt("Filtering...");
+	return 1;
+}
+
+/*
+ * Start recording the keys into the macro register `cmd[1]', or stop
+ * recording without it.  The keys are kept as they come from the
+ * terminal, up to the command that stops the recording.
+ * Format of a return value the same as for `do_cmd'.
+ */
+int
+do_macro()
+{
+	if (cmd[1] == '\n') {
+		if (mc_rec == 0)
 			return -1;
-		path[i+1] = '\0';
-		
-		SET_FILEPATH(path);
-		free(path);
+		mcs[mc_rec - 'a'].l = CLAMP_MAX(mc_cmd_x,
+		    mcs[mc_rec - 'a'].l);
+		mc_rec = 0;
 		return 0;
 	}
-	default:
+	if (!IS_MC(cmd[1]) || cmd[2] != '\n' || mc_rec != 0)
+		return -1;
+	if (mc_on) {
+		dpl_cmd_txt("Can't - a macro is being played.");
+		return 1;
+	}
+	
+	mc_rec = cmd[1];
+	mcs[mc_rec - 'a'].l = 0;
+	mc_cmd_x = 0;
+	/* What has come after the command is recorded as well. */
+	mc_add(in_buf+in_x, in_l);
+	return 0;
+}
+
+/*
+ * Play the macro from the register `cmd[1]' as many times as the
+ * number after it says (once, without a number).
+ * Format of a return value the same as for `do_cmd'.
+ */
+int
+do_play()
+{
+	struct mc* mc;
+	char* end;
+	unsigned long n;
+	
+	if (!IS_MC(cmd[1]))
 		return -1;
+	n = 1;
+	if (cmd[2] != '\n') {
+		n = strtoul(cmd+2, &end, 10);
+		if (end == cmd+2 || *end != '\n')
+			return -1;
+	}
+	
+	mc = &mcs[cmd[1] - 'a'];
+	if (mc_rec != 0) {
+		dpl_cmd_txt("Can't - a macro is being recorded.");
+		return 1;
+	}
+	if (mc_on) {
+		dpl_cmd_txt("Can't - a macro is being played.");
+		return 1;
+	}
+	if (mc->l == 0) {
+		dpl_cmd_txt("Can't - the macro is empty.");
+		return 1;
 	}
+	
+	/* What has come after the command waits until it's done. */
+	memcpy(mc_ta, in_buf+in_x, in_l);
+	mc_ta_l = in_l;
+	in_l = 0;
+	mc_on = 1;
+	mc_pl = mc;
+	mc_x = 0;
+	mc_n = n;
+	return 0;
 }
 
 /*
@@ -1847,6 +6882,7 @@ jmp_ln(size_t ln_num)
 	/* Don't do anything if we're already there. */
 	if (LN_Y == ln_num - 1)
 		return;
+	fd_reveal(ln_num - 1);
 	
 	top_off = ws_row / 2;
 	/*
@@ -1865,153 +6901,576 @@ jmp_ln(size_t ln_num)
 		nav_curs_y = top_off;
 	}
 	
+	off_x = 0;
 	ln_x = 0;
 	/*
 	 * Set `nav_curs_x', not `curs_x', because this is a
 	 * ``CMD'' command and after `nav_curs_x' tells where
 	 * to put cursor after quitting the prompt.
 	 */
-	nav_curs_x = 1;
+	nav_curs_x = 1;
+	
+	if (WR_MAP) {
+		wr_ctr = 1;
+		wr_fix();
+	}
+	else
+		DPL_PG();
+}
+
+/*
+ * Parse and execute the ``jump-to-line'' command.
+ * Return format is the same as for `do_cmd'.
+ */
+int
+do_jmp_ln()
+{
+	size_t ln_num;
+	char* cmdp = &cmd[1];
+	
+	ln_num = strtol(cmdp, &cmdp, 10);
+	if (ln_num == 0) {
+		if (IS_MARK(*cmdp) && *(cmdp+1) == '\n')
+			ln_num = mark2ln(*cmdp);
+		else
+			return -1;
+	}
+	
+	/*
+	 * Here we can be sure that there is _not_ a negative
+	 * or zero value in `ln_num', so we need to check only
+	 * for out-of-last-line overflow.
+	 */
+	if (ln_num > lns_l)
+		return -1;
+	
+	jmp_ln(ln_num);
+	return 0;
+}
+
+/*
+ * Quit the editor.
+ */
+void
+quit()
+{
+	CLN_CMD();
+	terminate();
+}
+
+/*
+ * Write lines [`from', `to') to `fd' starting at the file offset `off'
+ * or, if `off' is `-1', at its current offset.  Lines are gathered
+ * straight from their strings with pwritev(2) (or writev(2)), so
+ * nothing is copied.
+ * --
+ * Returns `0' on success or an errno(2) value otherwise.
+ */
+int
+wr_lns_at(int fd, size_t from, size_t to, off_t off)
+{
+	/* Every line takes two vectors: the string and the newline. */
+	struct iovec iov[IOV_MAX];
+	struct iovec* iovp;
+	int iovl;
+	ssize_t wb;
+	
+	while (from < to) {
+		for (iovl = 0; iovl+2 <= IOV_MAX && from < to; from++) {
+			iov[iovl].iov_base = lns[from]->str;
+			iov[iovl++].iov_len = lns[from]->l;
+			iov[iovl].iov_base = "\n";
+			iov[iovl++].iov_len = 1;
+		}
+		
+		iovp = iov;
+		while (iovl > 0) {
+			if (off == -1)
+				wb = writev(fd, iovp, iovl);
+			else
+				wb = pwritev(fd, iovp, iovl, off);
+			if (wb == -1) {
+				if (errno == EINTR)
+					continue;
+				return errno;
+			}
+			if (off != -1)
+				off += wb;
+			
+			/*
+			 * Skip the vectors that have been written completely
+			 * and trim the one that has been written partially.
+			 */
+			while (iovl > 0 && (size_t)wb >= iovp->iov_len) {
+				wb -= iovp->iov_len;
+				iovp++;
+				iovl--;
+			}
+			if (iovl > 0) {
+				iovp->iov_base = (char*)iovp->iov_base + wb;
+				iovp->iov_len -= wb;
+			}
+		}
+	}
+	
+	return 0;
+}
+
+#ifdef HAVE_URING
+/*
+ * Take the result `res' of the write of lines [`from', `to'), `sz'
+ * bytes of them, at the offset `off' of `fd'.  A short one is done
+ * once more with `wr_lns_at'.  The first error goes to `ret'.
+ */
+void
+ur_wr_done(int fd, size_t from, size_t to, off_t off, size_t sz, int res,
+    int* ret)
+{
+	if (*ret != 0)
+		return;
+	if (res < 0)
+		*ret = -res;
+	else if ((size_t)res < sz)
+		*ret = wr_lns_at(fd, from, to, off);
+}
+
+/*
+ * Write lines [`from', `to') to `fd' starting at the file offset `off'
+ * with io_uring(7).
+ * --
+ * Like `wr_lns_at', the lines are gathered straight from their
+ * strings: every request takes a run of them up to `IO_CHUNK' bytes
+ * long, and up to `IO_QD' requests are kept in flight.  In the rare
+ * case a write comes short, its run is written again.
+ * --
+ * Returns `0' on success, `ENOSYS' if the engine is not available or
+ * an errno(2) value otherwise.
+ */
+int
+ur_wr_lns(int fd, size_t from, size_t to, off_t off)
+{
+	struct uring ur;
+	/* `IOV_MAX' vectors for every request. */
+	struct iovec* iov;
+	struct iovec* v;
+	/*
+	 * Lines [`slot_from', `slot_to') of every request, how many bytes
+	 * they take, and their offset in the file (`-1' if the slot is
+	 * free).
+	 */
+	size_t slot_from[IO_QD];
+	size_t slot_to[IO_QD];
+	size_t slot_sz[IO_QD];
+	off_t slot_off[IO_QD];
+	unsigned n;
+	unsigned slot;
+	unsigned data;
+	int res;
+	int ret;
+	
+	if (ur_init(&ur, IO_QD) == -1)
+		return ENOSYS;
+	
+	iov = smalloc(IO_QD * IOV_MAX * sizeof(struct iovec));
+	for (slot = 0; slot < IO_QD; ++slot)
+		slot_off[slot] = -1;
+	ret = 0;
+	
+	for (slot = 0; ; slot = (slot+1) % IO_QD) {
+		/* Wait for the slot to get free. */
+		while (slot_off[slot] != -1) {
+			if (ur_get(&ur, &data, &res) == -1) {
+				ret = errno;
+				goto out;
+			}
+			ur_wr_done(fd, slot_from[data], slot_to[data],
+			    slot_off[data], slot_sz[data], res, &ret);
+			slot_off[data] = -1;
+		}
+		if (from == to || ret != 0)
+			break;
+		
+		/* Every line takes two vectors: the string and the newline. */
+		v = &iov[slot * IOV_MAX];
+		slot_from[slot] = from;
+		slot_sz[slot] = 0;
+		for (n = 0; n+2 <= IOV_MAX && from < to &&
+		    slot_sz[slot] < IO_CHUNK; from++) {
+			v[n].iov_base = lns[from]->str;
+			v[n++].iov_len = lns[from]->l;
+			v[n].iov_base = "\n";
+			v[n++].iov_len = 1;
+			slot_sz[slot] += lns[from]->l+1;
+		}
+		slot_to[slot] = from;
+		slot_off[slot] = off;
+		ur_put(&ur, IORING_OP_WRITEV, fd, v, n, off, slot);
+		off += slot_sz[slot];
+	}
+	
+out:
+	/*
+	 * Let the writes in flight finish before freeing their vectors.
+	 * They are taken as the ones above: the last runs count too.
+	 */
+	for (n = 0, slot = 0; slot < IO_QD; ++slot)
+		n += slot_off[slot] != -1;
+	while (n-- > 0) {
+		if (ur_get(&ur, &data, &res) == -1) {
+			if (ret == 0)
+				ret = errno;
+			break;
+		}
+		ur_wr_done(fd, slot_from[data], slot_to[data], slot_off[data],
+		    slot_sz[data], res, &ret);
+		slot_off[data] = -1;
+	}
+	free(iov);
+	ur_free(&ur);
+	return ret;
+}
+#endif
+
+/*
+ * Thread routine writing its share of lines out.  See `wr_job'.
+ */
+void*
+wr_thr(void* arg)
+{
+	struct wr_job* job;
+	
+	job = arg;
+#ifdef HAVE_URING
+	if (job->ur && (job->err = ur_wr_lns(job->fd, job->from, job->to,
+	    job->off)) != ENOSYS)
+		return NULL;
+#endif
+	job->err = wr_lns_at(job->fd, job->from, job->to, job->off);
+	return NULL;
+}
+
+/*
+ * Write lines [`from', `to') to `fd', which is expected to be empty.
+ * --
+ * The lines are split into blocks of `WR_BLK' lines and the prefix
+ * byte offset of every block is computed.  This way we know in advance
+ * both the size of the file (so we reserve the space for it at once)
+ * and where every block goes to, so large buffers are written by
+ * several threads into disjoint ranges of the file in parallel.  Each
+ * of them keeps its writes in flight with io_uring(7), if it is there
+ * (see `ur_wr_lns').
+ * --
+ * Returns `0' on success or an errno(2) value otherwise.
+ */
+int
+wr_lns_par(int fd, size_t from, size_t to)
+{
+	struct wr_job jobs[WR_THR_MAX];
+	pthread_t thrs[WR_THR_MAX];
+	/* Prefix offsets of blocks.  `blk_off[blk_n]' is the file size. */
+	off_t* blk_off;
+	size_t blk_n;
+	size_t blk;
+	long thr_n;
+	long t;
+	size_t i;
+	int ret;
+	
+	blk_n = (to-from + WR_BLK-1) / WR_BLK;
+	blk_off = smalloc((blk_n+1) * sizeof(off_t));
+	blk_off[0] = 0;
+	for (blk = 0; blk < blk_n; ++blk) {
+		blk_off[blk+1] = blk_off[blk];
+		for (i = from + blk*WR_BLK;
+		    i < to && i < from + (blk+1)*WR_BLK; ++i)
+			blk_off[blk+1] += lns[i]->l+1;
+	}
+	
+	/*
+	 * Not every file system supports reserving space, so only
+	 * its lack is a real error.
+	 */
+	if (blk_off[blk_n] > 0 &&
+	    (ret = posix_fallocate(fd, 0, blk_off[blk_n])) != 0 &&
+	    ret != EINVAL && ret != EOPNOTSUPP) {
+		free(blk_off);
+		return ret;
+	}
+	
+	thr_n = 1;
+	if (blk_off[blk_n] >= WR_PAR_MIN)
+		thr_n = CLAMP_MAX(sysconf(_SC_NPROCESSORS_ONLN), WR_THR_MAX);
+	if (thr_n < 1)
+		thr_n = 1;
+	
+	/*
+	 * Give every thread the run of blocks, so that each one gets
+	 * about the same number of bytes to write.
+	 */
+	blk = 0;
+	for (t = 0; t < thr_n; ++t) {
+		jobs[t].fd = fd;
+		jobs[t].from = CLAMP_MAX(from + blk*WR_BLK, to);
+		jobs[t].off = blk_off[blk];
+		while (blk < blk_n &&
+		    blk_off[blk] < blk_off[blk_n] / thr_n * (t+1))
+			blk++;
+		if (t == thr_n-1)
+			blk = blk_n;
+		jobs[t].to = CLAMP_MAX(from + blk*WR_BLK, to);
+		jobs[t].ur = blk_off[blk_n] >= IO_CHUNK;
+		jobs[t].err = 0;
+	}
+	free(blk_off);
+	
+	/*
+	 * The first share is written by the calling thread itself.
+	 * If a thread can not be started, its share is written here too.
+	 */
+	for (t = 1; t < thr_n; ++t) {
+		if (pthread_create(&thrs[t], NULL, wr_thr, &jobs[t]) != 0) {
+			wr_thr(&jobs[t]);
+			jobs[t].fd = -1;
+		}
+	}
+	wr_thr(&jobs[0]);
+	
+	ret = jobs[0].err;
+	for (t = 1; t < thr_n; ++t) {
+		if (jobs[t].fd != -1)
+			pthread_join(thrs[t], NULL);
+		if (ret == 0)
+			ret = jobs[t].err;
+	}
 	
-	DPL_PG();
+	return ret;
 }
 
 /*
- * Parse and execute the ``jump-to-line'' command.
- * Return format is the same as for `do_cmd'.
+ * Save lines [`from', `to') to the file at `path'.
+ * --
+ * The text is written to a temporary file next to the target one,
+ * which is synced and then renamed over the target.  So the target
+ * is never seen half-written, even if we crash during the write.
+ * The mode and owner of an existing target are preserved, and if
+ * it is a symbolic link, the file it points to is replaced.
+ * --
+ * Returns `0' on success and `1' otherwise (the reason is displayed).
  */
 int
-do_jmp_ln()
+wr_file(char* path, size_t from, size_t to)
 {
-	size_t ln_num;
-	char* cmdp = &cmd[1];
+	struct stat st;
+	/* Actual target path (symbolic links resolved). */
+	char* tgt;
+	/* Path of the temporary file. */
+	char* tmp;
+	char* dir;
+	mode_t msk;
+	int fd;
+	int ret;
 	
-	ln_num = strtol(cmdp, &cmdp, 10);
-	if (ln_num == 0) {
-		if (IS_MARK(*cmdp) && *(cmdp+1) == '\n')
-			ln_num = mark2ln(*cmdp);
-		else
-			return -1;
+	if (stat(path, &st) == 0) {
+		if ((tgt = realpath(path, NULL)) == NULL) {
+			dpl_cmd_txt("Can not open the file.");
+			return 1;
+		}
+	}
+	else {
+		tgt = smalloc(strlen(path)+1);
+		strcpy(tgt, path);
+		msk = umask(0);
+		umask(msk);
+		st.st_mode = 0666 & ~msk;
+		st.st_uid = -1;
+		st.st_gid = -1;
 	}
 	
-	/*
-	 * Here we can be sure that there is _not_ a negative
-	 * or zero value in `ln_num', so we need to check only
-	 * for out-of-last-line overflow.
-	 */
-	if (ln_num > lns_l)
-		return -1;
+	/* dirname(3) may modify its argument, so give it a copy. */
+	tmp = smalloc(strlen(tgt)+1);
+	strcpy(tmp, tgt);
+	dir = dirname(tmp);
+	dir = strcpy(smalloc(strlen(dir)+1), dir);
+	tmp = srealloc(tmp, strlen(dir)+sizeof("/.et.XXXXXX"));
+	strcpy(tmp, dir);
+	strcat(tmp, "/.et.XXXXXX");
+	free(dir);
+	
+	if ((fd = mkstemp(tmp)) == -1) {
+		free(tmp);
+		free(tgt);
+		dpl_cmd_txt("Can not open the file.");
+		return 1;
+	}
+	
+	ret = wr_lns_par(fd, from, to);
+	if (ret == 0 && fchmod(fd, st.st_mode & 07777) == -1)
+		ret = errno;
+	/* Only a superuser can change the owner, so don't insist. */
+	(void)fchown(fd, st.st_uid, st.st_gid);
+	if (ret == 0 && fsync(fd) == -1)
+		ret = errno;
+	if (close(fd) == -1 && ret == 0)
+		ret = errno;
+	if (ret == 0 && rename(tmp, tgt) == -1)
+		ret = errno;
+	
+	if (ret != 0)
+		unlink(tmp);
+	free(tmp);
+	free(tgt);
+	
+	if (ret != 0) {
+		dpl_cmd_txt("Error writing file.");
+		return 1;
+	}
 	
-	jmp_ln(ln_num);
 	return 0;
 }
 
 /*
- * Quit the editor.
+ * Parse a line address at `*cmdp' into `ln' (counting from 1) and
+ * advance `*cmdp' past it.  The address is either a line number, `.'
+ * for the current line, `$' for the last one or `'' followed by a
+ * line mark.
+ * --
+ * Returns `-1' if there is no valid address, `0' otherwise.
  */
-void
-quit()
+int
+parse_addr(char** cmdp, size_t* ln)
 {
-	CLN_CMD();
-	terminate();
+	ssize_t mark_ln;
+	
+	switch (**cmdp) {
+	case '.':
+		*ln = LN_Y+1;
+		break;
+	case '$':
+		*ln = lns_l;
+		break;
+	case '\'':
+		(*cmdp)++;
+		if (!(IS_MARK(**cmdp)) || (mark_ln = mark2ln(**cmdp)) == -1)
+			return -1;
+		*ln = mark_ln+1;
+		break;
+	default:
+		if (!isdigit(**cmdp))
+			return -1;
+		*ln = strtoul(*cmdp, cmdp, 10);
+		return *ln == 0 || *ln > lns_l ? -1 : 0;
+	}
+	
+	(*cmdp)++;
+	return 0;
 }
 
 /*
- * Write buffer contents to the file.
+ * Write lines [`from', `to') to the file.  The ``CMD'' is `w', the
+ * remains of which (after `w') are at `cmdp'.  `whole' tells if it
+ * is the whole buffer to be written.
+ * --
+ * The forms are:
+ *     `w[q] [path]' - replace the file with the lines.
+ *     `w >> [path]' - append the lines to the file.
+ * Without `path' the whole buffer goes to `filepath'.  Writing a part
+ * of the buffer, or appending it, does not touch the ``dirty'' state.
  * --
  * Return format obeys to `do_cmd'.
  */
 int
-do_write_file()
+wr_cmd(char* cmdp, size_t from, size_t to, char whole)
 {
-	char* cmdp = &cmd[1];
 	/* Do we need to quit editor after write. */
 	char q;
+	/* Do we append the lines to the file. */
+	char app;
 	/* A filepath the buffer will be written to. */
 	char* path;
 	/* Did we allocate memory for pathname. */
 	char alc_path;
-	/* A file descriptor for a target file. */
+	/* A file descriptor for a file we append to. */
 	int fd;
 	/* General purpose iterator. */
 	size_t i;
-	/* Buffer that will be written to the file. */
-	char* wbuf;
-	/* Length of a `wbuf'. */
-	size_t wbufl;
-	/* Iterator of a `wbuf'. */
-	size_t wbufi;
+	/* Result of writing the file. */
+	int ret;
 	
 	q = *cmdp == 'q';
 	
 	if (q)
 		cmdp++;
 	
-	switch (*cmdp) {
-	case '\n':
+	if (*cmdp != '\n' && *cmdp != ' ')
+		return -1;
+	while (*cmdp == ' ')
+		cmdp++;
+	
+	app = *cmdp == '>' && *(cmdp+1) == '>';
+	if (app) {
+		/* We don't quit after a partial write. */
+		if (q)
+			return -1;
+		cmdp += 2;
+		while (*cmdp == ' ')
+			cmdp++;
+	}
+	
+	if (*cmdp == '\n') {
 		alc_path = 0;
 		
+		/*
+		 * Replacing the buffer's file with a part of it, or
+		 * appending the buffer to itself is hardly intended.
+		 */
+		if (!whole || app) {
+			dpl_cmd_txt("Which filepath?  Do `w [>>] <path>'.");
+			return 1;
+		}
 		if (filepath == NULL) {
 			dpl_cmd_txt(
 "Which filepath?  Do either `w[q] <path>' or `f <path>'.");
 			return 1;
 		}
 		path = filepath;
-		break;
-	case ' ':		
+	}
+	else {
 		alc_path = 1;
 		
-		cmdp++;
 		path = smalloc(PATH_MAX+1);
 		for (i = 0; i < PATH_MAX; ++i) {
 			if (*(cmdp+i) == '\n')
 				break;
 			path[i] = *(cmdp+i);
 		}
-		if (i == 0)
-			return -1;
-		path[i+1] = '\0';
-		break;
-	default:
-		return -1;
+		path[i] = '\0';
 	}
 	
-	if (check_exists(path))
-		fd = open(path, O_WRONLY | O_TRUNC);
-	else
-		fd = open(path, O_CREAT | O_RDWR);
-	if (fd < 0) {
-		dpl_cmd_txt("Can not open the file.");
-		return 1;
+	if (app) {
+		ret = 1;
+		fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0666);
+		if (fd == -1)
+			dpl_cmd_txt("Can not open the file.");
+		else {
+			ret = wr_lns_at(fd, from, to, -1);
+			if (close(fd) == -1 && ret == 0)
+				ret = errno;
+			if (ret != 0)
+				dpl_cmd_txt("Error writing file.");
+		}
 	}
+	else
+		ret = wr_file(path, from, to);
 	/*
 	 * Do not free the path if we've used `filepath' for it.
 	 */
 	if (alc_path)
 		free(path);
-	
-	wbufl = 0;
-	for (i = 0; i < lns_l; ++i) {
-		wbufl += lns[i]->l+1;
-	}
-	
-	wbuf = smalloc(wbufl);
-	wbufi = 0;
-	for (i = 0; i < lns_l; ++i) {
-		strncpy(wbuf+wbufi, lns[i]->str, lns[i]->l);
-		wbufi += lns[i]->l;
-		wbuf[wbufi++] = '\n';
-	}
-	
-	if (write(fd, wbuf, wbufl) < 0) {
-		free(wbuf);
-		dpl_cmd_txt("Error writing file.");
+	if (ret != 0)
 		return 1;
-	}
-	free(wbuf);
-	close(fd);
 	
-	dirty = 0;
+	if (whole && !app)
+		dirty = 0;
 	
 	if (q)
 		quit();
@@ -2019,32 +7478,88 @@ do_write_file()
 	return 0;
 }
 
+/*
+ * Write buffer contents to the file.
+ * --
+ * Return format obeys to `do_cmd'.
+ */
+int
+do_write_file()
+{
+	return wr_cmd(&cmd[1], 0, lns_l, 1);
+}
+
+/*
+ * Parse and execute a command that is given a range of lines, like
+ * `10,20w path', `'a,'bw >> path' or `10,20z' (fold the lines).  A range
+ * is either one address or two ones separated with a comma (see
+ * `parse_addr').
+ * --
+ * Return format obeys to `do_cmd'.
+ */
+int
+do_rng_cmd()
+{
+	char* cmdp = cmd;
+	/* The first and the last lines of the range (counting from 1). */
+	size_t from;
+	size_t to;
+	
+	if (parse_addr(&cmdp, &from) == -1)
+		return -1;
+	to = from;
+	if (*cmdp == ',') {
+		cmdp++;
+		if (parse_addr(&cmdp, &to) == -1)
+			return -1;
+	}
+	if (from > to)
+		return -1;
+	
+	switch (*cmdp) {
+	case 'w':
+		/* Writing a range never quits the editor. */
+		if (*(cmdp+1) == 'q')
+			return -1;
+		return wr_cmd(cmdp+1, from-1, to, 0);
+	case 'z':
+		if (*(cmdp+1) != '\n' || from == to)
+			return -1;
+		fd_mk(from-1, to-1);
+		return 0;
+	default:
+		return -1;
+	}
+}
+
 /*
  * Insert one _printable_ character (and tab) under current
- * cursor position.
+ * cursor position.  It's `n' bytes `s' long (that are more
+ * than one for UTF-8).
  */
 void
-ins_char(char c)
+ins_char(const char* s, size_t n)
 {
 	/* Check if we have enough space for this character. */
-	if (lns[LN_Y]->l + 1 > lns[LN_Y]->sz)
+	if (lns[LN_Y]->l + n > lns[LN_Y]->sz)
 		EXPAND_LN(LN_Y, LN_EXPAND);
 	
 	/*
-	 * Shift stirng characters one character to the right,
+	 * Shift stirng characters `n' bytes to the right,
 	 * then insert the character in the empty space and
 	 * redraw the rest of the line.
 	 */
-	memmove(lns[LN_Y]->str+LN_X+1, lns[LN_Y]->str+LN_X,
-	    lns[LN_Y]->sz-LN_X-1);
+	memmove(lns[LN_Y]->str+LN_X+n, lns[LN_Y]->str+LN_X,
+	    lns[LN_Y]->l-LN_X);
 	ERS_LINE_FWD();
-	lns[LN_Y]->str[LN_X] = c;
-	lns[LN_Y]->l++;
+	memcpy(lns[LN_Y]->str+LN_X, s, n);
+	lns[LN_Y]->l += n;
+	TOUCH_LN(LN_Y, LN_X);
 	/*
 	 * In combination with `ERS_LINE_FWD' above it reprints
 	 * the rest part of this line only.
 	 */
-	write(STDOUT_FILENO, lns[LN_Y]->str+LN_X, lns[LN_Y]->l-LN_X);
+	dpl_ln(LN_Y, LN_X);
 	/*
 	 * We could just inserted tabulation character, that's why
 	 * we need to perform a complete navigation routine to keep
@@ -2067,14 +7582,18 @@ ins_ln_brk()
 	struct ln* last_unus;
 	
 	if (lns_l + 1 > lns_sz)
-		expand_lns();
+		expand_lns(1);
+	/* The new line would be in the middle of the fold. */
+	if (LN_Y < lns_l && lns[LN_Y]->fd_n != 0)
+		fd_open(LN_Y);
 	
 	/*
 	 * If we're inserting line break on the last _screen_ line,
 	 * but _not_ on the last _text_ line, we firstly scroll down
 	 * and then do the same routines we do for general case.
+	 * With hidden lines the screen is put in order by `wr_fix'.
 	 */
-	if (ln_y == ws_row - 1 && LN_Y != lns_l)
+	if (ln_y == (size_t)ws_row - 1 && LN_Y != lns_l && !HID_ANY)
 		scrl_dwn(1);
 	
 	/*
@@ -2100,6 +7619,8 @@ ins_ln_brk()
 	 */
 	lns[LN_Y+1] = last_unus;
 	lns_l++;
+	WR_MV(LN_Y+1);
+	vw_mv(LN_Y+1, 1);
 	
 	/*
 	 * The hunk of a line, that used to be after cursor,
@@ -2110,8 +7631,12 @@ ins_ln_brk()
 	if (lns[LN_Y+1]->l > lns[LN_Y+1]->sz)
 		EXPAND_LN(LN_Y+1, lns[LN_Y+1]->sz - lns[LN_Y+1]->l);
 	memcpy(lns[LN_Y+1]->str, lns[LN_Y]->str+LN_X, lns[LN_Y+1]->sz);
+	/* The end of the line is the new line's end now. */
+	lns[LN_Y+1]->hl_st = lns[LN_Y]->hl_st;
+	TOUCH_LN(LN_Y+1, 0);
 	/* Trim the current line to its present length. */
 	lns[LN_Y]->l = LN_X;
+	TOUCH_LN(LN_Y, LN_X);
 	
 	/*
 	 * Visually clean up the rest of the current line
@@ -2138,17 +7663,160 @@ ins_ln_brk()
 	}
 	else
 		dpl_pg(ln_y);
+	/* The new line is shown from its start. */
+	if (off_x != 0) {
+		off_x = 0;
+		DPL_PG();
+	}
+	
+	dirty = 1;
+	need_print_pos = 1;
+}
+
+/*
+ * Take one byte `c' of a UTF-8 character that is typed in, and insert
+ * the character once all its bytes are there.  Bytes that don't make
+ * a valid character are dropped.
+ */
+void
+ins_u8(char c)
+{
+	long cp;
+	
+	if (!IS_U8_CONT(c)) {
+		u8_in_l = 0;
+		if (u8_len(c) == 0)
+			return;
+	}
+	else if (u8_in_l == 0)
+		return;
+	
+	u8_in[u8_in_l++] = c;
+	if (u8_in_l == u8_len(u8_in[0])) {
+		if (u8_dec(u8_in, u8_in_l, &cp) == u8_in_l && cp >= 0xa0)
+			ins_char(u8_in, u8_in_l);
+		u8_in_l = 0;
+	}
+}
+
+/*
+ * Insert the block of text `s' (`n' bytes of it) at the cursor in one
+ * go, the cursor is put after it.  It's split into lines in one pass,
+ * the new lines are put in `lns' with one move of the pointers, and
+ * the screen is redrawn once.
+ * --
+ * Both `\r' and `\n' (and `\r\n') break the lines, and the control
+ * characters other than tabs are dropped.  `s' is changed.
+ */
+void
+ins_blk(char* s, size_t n)
+{
+	/* The number of the bytes kept and of the line breaks. */
+	size_t l;
+	size_t k;
+	size_t i;
+	size_t y;
+	/* The line being filled and where its part of `s' ends. */
+	struct ln* ln;
+	char* e;
+	/* The part of the current line after the cursor. */
+	char* tail;
+	size_t tail_l;
+	struct ln** nw;
+	
+	for (i = 0, l = 0, k = 0; i < n; ++i) {
+		if (s[i] == '\r' && i+1 < n && s[i+1] == '\n')
+			continue;
+		if (s[i] == '\r' || s[i] == '\n') {
+			s[l++] = '\n';
+			k++;
+		}
+		else if (s[i] == '\t' || IS_PRINTABLE(s[i]) ||
+		    (unsigned char)s[i] >= 0x80)
+			s[l++] = s[i];
+	}
+	if (l == 0)
+		return;
+	
+	if (k != 0 && lns[LN_Y]->fd_n != 0)
+		fd_open(LN_Y);
+	if (lns_l + k > lns_sz)
+		expand_lns(k);
+	
+	/* The spare lines at the end of `lns' go after the current one. */
+	if (k != 0) {
+		nw = smalloc(k * sizeof(struct ln*));
+		memcpy(nw, lns+lns_l, k * sizeof(struct ln*));
+		memmove(lns+LN_Y+1+k, lns+LN_Y+1,
+		    (lns_l-LN_Y-1) * sizeof(struct ln*));
+		memcpy(lns+LN_Y+1, nw, k * sizeof(struct ln*));
+		free(nw);
+		lns_l += k;
+		WR_MV(LN_Y+1);
+		vw_mv(LN_Y+1, k);
+	}
+	
+	ln = lns[LN_Y];
+	tail_l = ln->l - LN_X;
+	tail = smalloc(tail_l+1);
+	memcpy(tail, ln->str+LN_X, tail_l);
+	ln->l = LN_X;
+	for (y = LN_Y, i = 0; ; ++y) {
+		ln = lns[y];
+		e = memchr(s+i, '\n', l-i);
+		e = e == NULL ? s+l : e;
+		if (ln->l + (e - (s+i)) + tail_l > ln->sz)
+			EXPAND_LN(y, ln->l + (e - (s+i)) + tail_l - ln->sz);
+		memcpy(ln->str+ln->l, s+i, e - (s+i));
+		ln->l += e - (s+i);
+		TOUCH_LN(y, y == LN_Y ? LN_X : 0);
+		if (e == s+l)
+			break;
+		i = e+1 - s;
+	}
+	/* The cursor goes between the block and the tail. */
+	ln_x = ln->l;
+	memcpy(ln->str+ln->l, tail, tail_l);
+	ln->l += tail_l;
+	if (k != 0)
+		ln->hl_st = lns[LN_Y]->hl_st;
+	free(tail);
+	
+	ln_y += k;
+	wr_dpl = 1;
+	vw_fit();
+	if (!WR_MAP)
+		DPL_PG();
+	SYNC_CURS();
 	
 	dirty = 1;
 	need_print_pos = 1;
 }
 
+/*
+ * Take in what is being pasted (see `rd_pst'): it's inserted as text,
+ * even in ``NAV'' mode, where its keys would be commands otherwise.
+ */
+void
+ins_pst()
+{
+	char* s;
+	size_t n;
+	
+	s = rd_pst(&n);
+	ins_blk(s, n);
+	free(s);
+}
+
 /*
  * Delete one character backward at current cursor position.
  */
 void
 del_char_back()
 {
+	/* Number of bytes of the deleted character. */
+	size_t n;
+	
 	/*
 	 * If we're about to delete first character in the line,
 	 * then, if there is a line above, we want to append
@@ -2167,6 +7835,10 @@ del_char_back()
 		
 		if (LN_Y == 0)
 			return;
+		/* Folds are not joined, nor split. */
+		if (lns[LN_Y]->fd_n != 0)
+			fd_open(LN_Y);
+		fd_reveal(LN_Y-1);
 		if (ln_y == 0)
 			scrl_up(1);
 		
@@ -2182,6 +7854,7 @@ del_char_back()
 		    lns[LN_Y]->l);
 		
 		pr_len = lns[LN_Y]->l;
+		lns[LN_Y-1]->hl_st = lns[LN_Y]->hl_st;
 		FREE_LN(LN_Y);
 		/* Move all the lines that were below current line, up. */
 		memcpy(lns+LN_Y, lns+LN_Y+1,
@@ -2199,7 +7872,7 @@ del_char_back()
 		 */
 		if (LN_Y == lns_l - 1) {
 			ERS_LINE_FWD();
-			dprintf(STDOUT_FILENO, EMPT_LN_MARK);
+			scr_str(EMPT_LN_MARK);
 		}
 		
 		/*
@@ -2208,23 +7881,21 @@ del_char_back()
 		 */
 		lns_l--;
 		lns_sz--;
+		WR_MV(LN_Y);
+		vw_mv(LN_Y, -1);
 		curs_y--;
-		curs_x = char2col(LN_Y-1, lns[LN_Y-1]->l);
 		ln_y--;
 		ln_x = lns[LN_Y]->l;
+		lns[LN_Y]->l += pr_len;
+		TOUCH_LN(LN_Y, LN_X);
+		curs_x = scrl_to_col(char2col(LN_Y, LN_X));
 		SYNC_CURS();
 		
 		/*
 		 * Visually append current line to the end of
 		 * the previous one.
 		 */
-		write(STDOUT_FILENO, lns[LN_Y]->str+lns[LN_Y]->l, pr_len);
-		/*
-		 * So far we've being referring to previous line initial
-		 * length, but from now on, we are not going to do this
-		 * anymore and we can alter it.
-		 */
-		lns[LN_Y]->l += pr_len;
+		dpl_ln(LN_Y, LN_X);
 		
 		/*
 		 * `dpl_pg' makes sense only in case of a not-last line
@@ -2241,28 +7912,32 @@ del_char_back()
 	
 	/*
 	 * Plain deleting one character back.
-	 * Since we still need to handle tab stops, we employ
-	 * the `nav_left', which already includes this logic.
+	 * Since we still need to handle tab stops (and characters
+	 * of many bytes), we employ the `nav_left', which already
+	 * includes this logic.
 	 */
 	
+	n = LN_X;
 	nav_left();
+	n -= LN_X;
 	
 	/*
-	 * Shift the entire string one character left.
+	 * Shift the entire string `n' bytes left.
 	 * Bear in mind, that due to the prior call of `nav_left',
 	 * we now assume that ``current'' `LN_X' is that one that was
 	 * before the original one.
 	 */
-	memcpy(lns[LN_Y]->str+LN_X, lns[LN_Y]->str+LN_X+1,
-	    lns[LN_Y]->sz-LN_X);
-	lns[LN_Y]->l--;
-	lns[LN_Y]->sz--;
+	memmove(lns[LN_Y]->str+LN_X, lns[LN_Y]->str+LN_X+n,
+	    lns[LN_Y]->l-LN_X-n);
+	lns[LN_Y]->l -= n;
+	lns[LN_Y]->sz -= n;
+	TOUCH_LN(LN_Y, LN_X);
 	
 	/*
 	 * Redraw everything in this line after the cursor.
 	 */
 	ERS_LINE_FWD();
-	write(STDOUT_FILENO, lns[LN_Y]->str+LN_X, lns[LN_Y]->l-LN_X);
+	dpl_ln(LN_Y, LN_X);
 }
 
 /*
@@ -2306,6 +7981,9 @@ handle_char(char c)
 		/* FALLTHROUGH. */
 	case ':':
 	case '/':
+		/* The command that stops recording is left out of it. */
+		if (mc_rec != 0)
+			mc_cmd_x = mcs[mc_rec - 'a'].l - in_l - 1;
 		if (in_sea == 0)
 			esc_cmd(c == '/');
 		else
@@ -2345,11 +8023,15 @@ handle_char(char c)
 			nav_up();
 		break;
 	case CTRL('l'):
-		if (mod == MOD_NAV)
+		if (mod == MOD_NAV && WR_MAP)
+			wr_scrl(SCRL_LN, 1);
+		else if (mod == MOD_NAV)
 			scrl_dwn(SCRL_LN);
 		break;
 	case CTRL('k'):
-		if (mod == MOD_NAV)
+		if (mod == MOD_NAV && WR_MAP)
+			wr_scrl(SCRL_LN, 0);
+		else if (mod == MOD_NAV)
 			scrl_up(SCRL_LN);
 		break;
 	case '>':
@@ -2360,6 +8042,10 @@ handle_char(char c)
 		if (mod == MOD_NAV)
 			scrl_start();
 		break;
+	case CTRL('w'):
+		if (mod == MOD_NAV || mod == MOD_EDT)
+			vw_nx();
+		break;
 	case CTRL('a'):
 		if (mod == MOD_NAV)
 			nav_ln_start();
@@ -2384,7 +8070,9 @@ handle_char(char c)
 		if (mod == MOD_EDT) {
 put_char:
 			if (IS_PRINTABLE(c) || c == '\t')
-				ins_char(c);
+				ins_char(&c, 1);
+			else if ((unsigned char)c >= 0x80)
+				ins_u8(c);
 			/* `Enter' key generates it. */
 			else if (c == '\r')
 				ins_ln_brk();
@@ -2394,6 +8082,59 @@ put_char:
 	}
 }
 
+/*
+ * Handle the key `k' (`KEY_*') that has come as an escape sequence.
+ * Unlike the letters, the cursor keys move the cursor in ``EDT'' mode
+ * as well.
+ */
+void
+handle_key(int k)
+{
+	if (k == KEY_ESC) {
+		handle_char(ESC);
+		return;
+	}
+	if (k == KEY_PST) {
+		ins_pst();
+		return;
+	}
+	if (mod != MOD_NAV && mod != MOD_EDT)
+		return;
+	
+	switch (k) {
+	case KEY_UP:
+		nav_up();
+		break;
+	case KEY_DOWN:
+		nav_dwn();
+		break;
+	case KEY_RIGHT:
+		nav_right();
+		break;
+	case KEY_LEFT:
+		nav_left();
+		break;
+	case KEY_HOME:
+		nav_ln_start();
+		break;
+	case KEY_END:
+		nav_ln_end();
+		break;
+	case KEY_PGUP:
+		if (WR_MAP)
+			wr_scrl(ws_row, 0);
+		else
+			scrl_up(ws_row);
+		break;
+	case KEY_PGDN:
+		if (WR_MAP)
+			wr_scrl(ws_row, 1);
+		else
+			scrl_dwn(ws_row);
+		break;
+	}
+}
+
 /*
  * Execute the command, read by `read_cmd' into `cmd' buffer.
  * Returns `0' if command is successfull and we need to immediately
@@ -2428,8 +8169,32 @@ do_cmd_cmd()
 			return do_jmp_ln();
 		case 'k':
 			return do_mark_ln();
+		case 'm':
+			return do_macro();
+		case '@':
+			return do_play();
 		case 'w':
 			return do_write_file();
+		case 'h':
+			return do_hl();
+		case 's':
+			return do_wrap();
+		case 'z':
+		case 'Z':
+			return do_fold();
+		case '&':
+			return do_filter();
+		case 'x':
+		case 'v':
+			return do_split();
+		case 'c':
+			return do_close();
+		case '\'':
+		case '.':
+		case '$':
+		case '0': case '1': case '2': case '3': case '4':
+		case '5': case '6': case '7': case '8': case '9':
+			return do_rng_cmd();
 		default:
 			return -1;
 		}
@@ -2453,9 +8218,13 @@ do_sea()
 	int mat_len;
 	/* Previous index of line where we met match. */
 	ssize_t prv_mat_i;
+	int k;
+	size_t pst_l;
+	/* Whether the screen is to be redrawn for the new match. */
+	char rdr;
 	
 	if (in_sea == 1)
-		clean_sea(1);
+		clean_sea();
 	
 	in_sea = 0;
 	mat_off = LN_X;
@@ -2488,21 +8257,26 @@ nx_sea:
 		 */
 		if (mat_p != NULL) {
 			in_sea = 1;
-			if (prv_mat_i != -1) {
-				MV_CURS_SF(curs_y_tmp, curs_x_tmp);
-				write(STDIN_FILENO,
-				    lns[prv_mat_i]->str+mat_off, fnd_i);
-			}
-			
-			jmp_ln(mat_i+1);
+			/* The line hasn't been drawn with this match. */
+			rdr = prv_mat_i == -1 || mat_i == LN_Y;
 			mat_off = prv_mat_off = mat_p-lns[mat_i]->str;
+			jmp_ln(mat_i+1);
 			mat_len = fnd_i;
-			ln_x_tmp = off_x+mat_off;
+			ln_x_tmp = mat_off;
 			ln_y_tmp = mat_i-off_y;
-			curs_x_tmp = char2col(mat_i, mat_off);
-			curs_y_tmp = ln_y_tmp+1;
+			curs_x_tmp = scrl_to_col(char2col(mat_i, mat_off));
+			curs_y_tmp = !WR_MAP ? ln_y_tmp+1 :
+			    wr_scr_row(mat_i) + (wrap ? off_x/wrap_w : 0);
+			/*
+			 * All the matches on the screen are drawn in
+			 * reverse video, and the current one is
+			 * underlined (see `dpl_span').  The screen has
+			 * been redrawn by `jmp_ln' unless it's on the
+			 * same line.
+			 */
+			if (rdr)
+				vw_dpl_all();
 			MV_CURS_SF(curs_y_tmp, curs_x_tmp);
-			WR_REV_VID("%.*s", mat_len, lns[mat_i]->str+mat_off);
 			print_cmd();
 		}
 		
@@ -2536,11 +8310,16 @@ nx_sea:
 				mat_i = prv_mat_i;
 		}
 		while (mat_p != NULL || out) {
-			arb = read(STDIN_FILENO, &nav, 1);
+			arb = rd_in(&nav);
 			if (arb != 1)
 				continue;
 			switch (nav) {
 			case ESC:
+				/* Other keys and a paste mean nothing. */
+				if ((k = in_key()) == KEY_PST)
+					free(rd_pst(&pst_l));
+				if (k != KEY_ESC)
+					continue;
 				goto quit_sea;
 			case BSP:
 			case DEL:
@@ -2627,6 +8406,7 @@ do_sub()
 				EXPAND_LN(i, diff);
 			}
 			lns[i]->l += diff;
+			TOUCH_LN(i, mat_off);
 			mat_off += sub_i;
 		    }
 	}
@@ -2665,7 +8445,6 @@ exec_sea()
 	flg = 0;
 	state = 0;
 	pesc = 0;
-	prev_fnd_i = fnd_i;
 	fnd_i = 0;
 	sub_i = 0;
 	has_sub = 0;
@@ -2752,43 +8531,35 @@ void
 input_loop()
 {
 	for (;;) {
-		while (read(STDIN_FILENO, &buf, 1) == 1) {
+		while (rd_in(buf) == 1) {
 			/*
 			 * If we have just read an `ESC' character it either
 			 * means that we've just literally hit `ESC' key or
-			 * we stroke a key that generates an escape sequence.
-			 * We want to completely throw the later out (i.e
-			 * ignore it).  We don't need them, 'cause this editor
-			 * doesn't make use of any of these.
+			 * we stroke a key that generates an escape sequence
+			 * (or something is being pasted).  `in_key' tells
+			 * which one.
 			 */
-			if (buf[0] == ESC) {
-				char dummy;
-				
-				/*
-				 * Make use of the `VTIME' flag that we've set
-				 * in `set_raw'.  It means, that read(2) will
-				 * return if nary characters have been read
-				 * within 100 ms.  I.e. it will not hang here.
-				 */
-				if (read(STDIN_FILENO, &dummy, 1) == 1 &&
-				    read(STDIN_FILENO, &dummy, 1) == 1)
-				    	continue;
-			}
-			
-			/*
-			 * In case it's an ordinary key or a _single_ `ESC',
-			 * we do handle that character.
-			 */
-			handle_char(*buf);
+			if (buf[0] == ESC)
+				handle_key(in_key());
+			else
+				handle_char(*buf);
+			wr_fix();
 			
 			/*
 			 * Different actions in `handle_char' can set
 			 * `need_print_pos' flag if they adjust the cursor
-			 * position.
+			 * position.  There's no need to print it until
+			 * all the keys that have come are handled, and
+			 * not over a message the last of them has left.
 			 */
-			if (need_print_pos) {
-				print_pos();
-				need_print_pos = 0;
+			if (!in_pend()) {
+				hl_upd();
+				vw_upd();
+				if (need_print_pos && mod != MOD_CMD &&
+				    mod != MOD_SEA) {
+					print_pos();
+					need_print_pos = 0;
+				}
 			}
 		}
 	}
@@ -2801,16 +8572,22 @@ void
 get_win_sz()
 {
 	struct winsize win_sz;
+	US rows;
+	US cols;
 	
 	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &win_sz) == -1)
 		err(1, "Can not obtain the terminal window size");
 	
 	/*
 	 * One line (at the bottom) is for entering commands and
-	 * status bar.
+	 * status bar.  The rest is split into views (see `vw_rsz').
 	 */
-	ws_row = win_sz.ws_row - 1;
-	ws_col = win_sz.ws_col;
+	rows = scr_rows;
+	cols = scr_cols;
+	scr_rows = win_sz.ws_row;
+	scr_cols = win_sz.ws_col;
+	scr_init();
+	vw_rsz(rows, cols);
 }
 
 /*
@@ -2824,38 +8601,108 @@ handle_sigwinch()
 	 * If current cursor position will not be visible after
 	 * resizing (more accurately, shrinking) the window, we
 	 * scroll so that the current line on which the cursor
-	 * is is on the last visible line.
+	 * is is on the last visible line (see `vw_fit').  Every
+	 * line may take another number of rows now.
 	 */
-	if (ln_y >= ws_row) {
-		off_y += (ln_y - ws_row+1);
-		ln_y = ws_row-1;
-		curs_y = ws_row;
-	}
-	DPL_PG();
+	vw_lay();
 	if (mod == MOD_CMD || mod == MOD_SEA)
 		print_cmd();
 }
 
+/*
+ * The window size has settled (see `rd_sigwinch').
+ */
+void
+rsz_tm_exp(int fd)
+{
+	ev_drain(fd);
+	rsz_pend = 0;
+	handle_sigwinch();
+}
+
+/*
+ * The main loop's handler of `SIGWINCH' (see `init_win_sz').
+ * --
+ * While the window is being dragged, the signals come one after
+ * another.  The first one starts `rsz_tm', the ones that come before
+ * it expires just go with it, and then the screen is laid out once,
+ * for the size the window has by then.
+ */
+void
+rd_sigwinch(int fd)
+{
+	ev_drain(fd);
+	if (rsz_pend)
+		return;
+	if (rsz_tm == -1) {
+		handle_sigwinch();
+		return;
+	}
+	rsz_pend = 1;
+	tm_set(rsz_tm, RSZ_DELAY);
+}
+
+#ifndef HAVE_EVFD
+/*
+ * Pass the signal on to the main loop.
+ */
+void
+sig_to_pp(int sig)
+{
+	int e;
+	
+	e = errno;
+	(void)write(ev_sig_pp[1], "", 1);
+	errno = e;
+}
+#endif
+
 /*
  * Set up a routine that will update window size information every
  * time it changes.
+ * --
+ * `SIGWINCH' is not handled when it comes, but read by the main loop
+ * from a signalfd(2) (or a pipe the signal handler writes to), so that
+ * it is handled between the keys.
  */
 void
 init_win_sz()
 {
+	sigset_t set;
+#ifdef HAVE_EVFD
+	int fd;
+#else
 	struct sigaction sa;
+#endif
 	
 	get_win_sz();
 	
+	sigemptyset(&set);
+	sigaddset(&set, SIGWINCH);
+#ifdef HAVE_EVFD
+	/* The threads made later inherit the blocked signal. */
+	if (sigprocmask(SIG_BLOCK, &set, NULL) == -1 ||
+	    (fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC)) == -1)
+		err(1, "Can not set up the window size updates");
+	ev_add(fd, rd_sigwinch);
+	rsz_tm = tm_new(rsz_tm_exp);
+#else
+	if (pipe(ev_sig_pp) == -1)
+		err(1, "Can not set up the window size updates");
+	fcntl(ev_sig_pp[0], F_SETFL, O_NONBLOCK);
+	fcntl(ev_sig_pp[1], F_SETFL, O_NONBLOCK);
+	ev_add(ev_sig_pp[0], rd_sigwinch);
+	
 	/*
 	 * It is important to initialize all fields for `sa',
 	 * because otherwise they are filled with random
 	 * values and it may (and will) lead to `EINVAL'.
 	 */
-	sa.sa_handler = handle_sigwinch;
-	sa.sa_flags = 0;
-	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = sig_to_pp;
+	sa.sa_flags = SA_RESTART;
+	sa.sa_mask = set;
 	sigaction(SIGWINCH, &sa, NULL);
+#endif
 }
 
 /*
@@ -2892,7 +8739,7 @@ main(int argc, char** argv)
 	if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO))
 		errx(1, "Both input and output should go to the terminal");
 	
-	expand_lns();
+	expand_lns(1);
 		
 	if (argc > 3)
 		errx(1, "I can edit only one thing at a time");
@@ -2925,8 +8772,9 @@ anon:
 	}
 	
 	set_raw();
-	setup_terminal();
+	ev_init();
 	init_win_sz();
+	setup_terminal();
 	
 	DPL_PG();
 	/* Move cursor to the first visible character. */